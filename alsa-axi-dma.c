@@ -3,26 +3,87 @@
  *
  * This driver provides a basic ALSA PCM device that uses a DMA channel
  * to transfer audio samples from kernel-allocated buffers to a target device.
- * It sets up a single sound card and a single PCM playback device, where audio
+ * It sets up one sound card with a single PCM device per AXI DMA core, where audio
  * data is pulled from the ALSA buffer and converted into a 64-bit word format
- * per frame before being sent out through the DMA engine.
+ * per frame before being sent out through the DMA engine. With a second DMA
+ * channel the device also records: captured 64-bit words are unpacked into
+ * the ALSA buffer again.
  *
  * Supported Audio Format:
  * - Signed 24-bit samples, packed in 3 bytes per sample (S24_3LE)
  * - Signed 24-bit samples in 4-byte containers (S24_LE), where the fourth byte
  *   is ignored to maintain the same 64-bit frame structure.
+ * - Signed 32-bit samples (S32_LE), truncated to their 24 most significant bits.
+ * - Signed 16-bit samples (S16_LE), shifted into the top of the 24-bit slot.
+ * - Hardware-native 64-bit words (exposed as DSD_U32_BE), transferred without
+ *   copying straight from the ALSA buffer. Only offered with the module parameter
+ *   native_format=1, so DSD applications do not pick it up by accident.
  *
  * Supported Configuration:
- * - Stereo (2-channel) only
- * - 48 kHz sample rate
+ * - Stereo (2-channel) by default, up to 8 channels in TDM slots (module
+ *   parameters tdm_slots and channel_map), 2 slots per 64-bit word
+ * - 48 kHz sample rate by default, other rates (8 - 192 kHz) through the module
+ *   parameter rates, the min period size scales with the rate and the queue depth
  * - Hardware parameters such as period size and buffer size are restricted to
  *   specific ranges to ensure stable operation.
  *
  * Operation:
- * - The driver allocates a continuous DMA buffer and uses DMA transfers to 
+ * - The ALSA buffer is a managed, cached and DMA-able buffer of the DMA device,
+ *   mmap-capable for low-latency clients.
+ * - The driver allocates a continuous DMA buffer per stream at probe, reused
+ *   across opens and grown to the negotiated staging ring, and uses DMA transfers to 
  *   feed samples to the hardware. When a period completes, a DMA completion 
  *   callback triggers a workqueue job to safely interact with ALSA APIs, 
  *   mark the period as elapsed, and start transferring the next period.
+ * - Playback frames are packed as soon as the application commits them (ack
+ *   callback), so the refill work only queues periods that are packed already.
+ * - Optionally (module parameter direct_copy=1) the copy callbacks pack playback
+ *   straight from the application into the DMA buffer, bypassing the ALSA buffer.
+ * - Optionally (module parameter sg=1) both buffers are noncontiguous cached buffers,
+ *   every period is queued as a scatterlist over the pages it spans and synced like
+ *   a noncoherent buffer.
+ * - Optionally (module parameter noncoherent=1) the DMA buffer is cached memory,
+ *   every slot is synced for the DMA before it is queued and for the CPU after capture.
+ * - Optionally (module parameter free_run=1) underruns are padded with silence
+ *   and the DMA keeps running, ALSA's stop_threshold decides about the xrun.
+ * - Optionally (module parameter cyclic=1) one cyclic DMA transfer runs over a
+ *   ring of packed periods, so the engine never goes idle between periods and
+ *   the work handler only refills the slots behind the hardware. The descriptor
+ *   is prearmed at prepare, trigger start only issues it.
+ * - Without cyclic support, up to 4 one-shot transfers (module parameter
+ *   pipeline_depth) are kept in flight from alternating slots of the DMA buffer,
+ *   optionally only every N-th of them interrupts (module parameter irq_interval).
+ * - The streaming path is lock-free towards the pointer callback (sequence counter over
+ *   the ring indices) and takes no mutex, so trigger can run in atomic context. The PCM
+ *   is nonatomic unless the refill runs in the DMA callback, so packing under the stream
+ *   lock keeps interrupts enabled and can use NEON.
+ * - The hardware pointer is derived from the DMA residue when the engine
+ *   reports it below descriptor granularity, giving sub-period positions.
+ * - Link audio timestamps (SNDRV_PCM_INFO_HAS_LINK_ATIME) pair the position with the
+ *   time of the DMA completion, or of the residue read, instead of the refill work.
+ * - The refill work runs on the system workqueue, a dedicated high-priority
+ *   workqueue (optionally pinned to one CPU), a SCHED_FIFO kthread or directly
+ *   in the DMA completion callback (module parameter refill_mode).
+ * - The module is a platform driver: every device tree node (compatible
+ *   "alsa-axi-dma") gets its own card, channels, refill context and statistics,
+ *   so instances on several AXI DMA cores complete in parallel. Without a node
+ *   1 legacy device is created on the named channels of the module parameters.
+ * - Playback volume and mute per channel (mixer controls "PCM Playback Volume" and
+ *   "PCM Playback Switch") are applied as a fixed-point gain while packing, at 0 dB
+ *   the format packers run unchanged.
+ * - Runtime PM releases the DMA channels once no stream was open for autosuspend_ms
+ *   and requests them again at open. Streams survive a system suspend through the
+ *   suspend and resume triggers (SNDRV_PCM_INFO_RESUME).
+ * - Playback runs on the MM2S channel ("tx", or module parameter playback_channel)
+ *   and capture on the S2MM channel ("rx", or module parameter capture_channel)
+ *   of the AXI DMA, both use the same cyclic/pipelined engine for full-duplex operation.
+ * - The streaming path is traced with tracepoints (trace system dma_alsa) instead
+ *   of kernel log messages.
+ * - Latency, headroom and underrun statistics are kept per stream and exposed in
+ *   debugfs (alsa-axi-dma/<device>/playback_stats and capture_stats), a write to the file
+ *   resets them.
+ * - Built with the selftest (make SELFTEST=1), debugfs also offers a benchmark of the
+ *   packers and a loopback run of the refill pipeline over a memcpy DMA channel.
  * - The PCM operations (open, close, hw_params, prepare, trigger, etc.) are 
  *   implemented to interact seamlessly with ALSA applications, ensuring that 
  *   streams can be started, stopped, paused, or resumed without glitches.
@@ -40,44 +101,172 @@
 #include <linux/init.h>
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
-#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/scatterlist.h>
+#include <linux/seqlock.h>
+#include <linux/hrtimer.h>
+#include <linux/completion.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/swab.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
+#include <linux/property.h>
+#include <linux/of.h>
+#include <asm/unaligned.h>
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
+#include <sound/control.h>
+#include <sound/tlv.h>
+
+#define CREATE_TRACE_POINTS
+#include "alsa_axi_dma_trace.h"
 
 #define PCM_DEVICE_NAME "dma_pcm"           // PCM device name
 #define CARD_NAME "DMA Audio Card"          // Audio card name
+#define DMA_ALSA_DRIVER_NAME "alsa-axi-dma" // Platform driver and legacy device name
+#define DMA_ALSA_COMPATIBLE "alsa-axi-dma"  // Device tree compatible of an instance
 #define AUDIO_BUFFER_SIZE (256 * 1024)      // 256 KB max audio buffer = 900ms of latency
+#define DMA_STAGING_PREALLOC (64 * 1024)    // Staging ring allocated at probe, grown at hw_params up to AUDIO_BUFFER_SIZE
+#define DMA_WORD_BYTES 8                    // Bytes per packed DMA word (2 slots of 24 bits + 16 zero bits)
+#define DMA_MAX_TDM_SLOTS 8                 // Max number of 24-bit slots per frame (4 words)
+#define DMA_MAX_PIPELINE_DEPTH 4            // Max number of one-shot descriptors in flight
+#define DMA_MAX_PERIODS 32                  // Max number of periods in the ALSA buffer (and ring slots)
+#define DMA_PERIOD_BYTES_MIN 4096          // Min period size at DMA_REFERENCE_RATE with 1 period in flight
+#define DMA_PERIOD_BYTES_MAX (64 * 1024)    // Max period size
+#define DMA_PERIOD_FRAMES_MIN 64            // Min period size at DMA_REFERENCE_RATE when periods are queued ahead
+#define DMA_QUEUED_FRAMES_MIN 256           // Frames at DMA_REFERENCE_RATE queued ahead of the hardware at least
+#define DMA_REFERENCE_RATE 48000            // Rate the period size window is given for, it scales with the rate
+#define DMA_MAX_RATES 8                     // Max number of entries in the rates parameter
+#define DMA_SG_MAX_ENTS (AUDIO_BUFFER_SIZE / PAGE_SIZE + 1) // Max scatterlist entries of one period in sg mode
+#define DMA_COPY_BOUNCE_BYTES 1024          // User data staged per step of the direct copy, stays in L1
+#define DMA_STATS_HIST_BUCKETS 16           // Log2 latency buckets in us: < 1 us, < 2 us, ... , >= 16 ms
+#define DMA_VOLUME_MAX 120                  // Mixer volume of 0 dB, 0.5 dB steps down to mute at 0
+#define DMA_GAIN_SHIFT 24                   // Fractional bits of the software gain
+#define DMA_GAIN_UNITY (1U << DMA_GAIN_SHIFT)
+
+/*
+ * Hardware-native passthrough format: every frame already is the packed 64-bit word
+ * ALSA has no format for this layout, the DSD container is used as an opaque 32-bit
+ * per channel label so that plug/route never converts into it by accident
+ */
+#define DMA_PCM_FORMAT_NATIVE SNDRV_PCM_FORMAT_DSD_U32_BE
+#define DMA_PCM_FMTBIT_NATIVE SNDRV_PCM_FMTBIT_DSD_U32_BE
+
+static unsigned int dma_frame_bytes;                    // Bytes per packed frame, tdm_slots / 2 words
+
+// Execution contexts for the refill work
+enum dma_refill_mode {
+    DMA_REFILL_SYSTEM_WQ,       // Shared system workqueue
+    DMA_REFILL_HIGHPRI_WQ,      // Dedicated WQ_HIGHPRI | WQ_UNBOUND workqueue
+    DMA_REFILL_CPU_WQ,          // Dedicated WQ_HIGHPRI workqueue, work pinned to refill_cpu
+    DMA_REFILL_RT_KTHREAD,      // Dedicated SCHED_FIFO kthread worker
+    DMA_REFILL_CALLBACK,        // Directly in the DMA completion callback, no context switch
+};
+
+// Module parameters
+static bool cyclic;
+module_param(cyclic, bool, 0444);
+MODULE_PARM_DESC(cyclic, "Run one cyclic DMA descriptor over a ring of packed periods (default: off)");
+
+static unsigned int pipeline_depth = 1;
+module_param(pipeline_depth, uint, 0444);
+MODULE_PARM_DESC(pipeline_depth, "Number of one-shot DMA descriptors kept in flight, 1-4 (default: 1)");
+
+static unsigned int refill_mode = DMA_REFILL_SYSTEM_WQ;
+module_param(refill_mode, uint, 0444);
+MODULE_PARM_DESC(refill_mode, "Refill context: 0=system wq, 1=highpri unbound wq, 2=highpri wq on refill_cpu, 3=RT kthread, 4=DMA callback (default: 0)");
+
+static bool use_neon = true;
+module_param_named(neon, use_neon, bool, 0444);
+MODULE_PARM_DESC(neon, "Use the NEON frame packers when available (default: on)");
+
+static unsigned int rates[DMA_MAX_RATES] = { 48000 };
+static int num_rates = 1;
+module_param_array(rates, uint, &num_rates, 0444);
+MODULE_PARM_DESC(rates, "Sample rates supported by the downstream I2S/serializer clock, unless the device tree lists them (default: 48000)");
+
+static unsigned int tdm_slots = 2;
+module_param(tdm_slots, uint, 0444);
+MODULE_PARM_DESC(tdm_slots, "Number of 24-bit slots per hardware frame, 2 per 64-bit word: 2, 4, 6 or 8 (default: 2)");
+
+static unsigned int channel_map[DMA_MAX_TDM_SLOTS];
+static int num_channel_map;
+module_param_array(channel_map, uint, &num_channel_map, 0444);
+MODULE_PARM_DESC(channel_map, "ALSA channel carried by every hardware slot, unused channels give silence (default: identity)");
+
+static unsigned int refill_cpu;
+module_param(refill_cpu, uint, 0444);
+MODULE_PARM_DESC(refill_cpu, "CPU that runs the refill work when refill_mode=2 (default: 0)");
+
+static unsigned int irq_interval = 1;
+module_param(irq_interval, uint, 0444);
+MODULE_PARM_DESC(irq_interval, "Interrupt only every N one-shot DMA periods, the last queued period always interrupts (default: 1)");
+
+static bool free_run;
+module_param(free_run, bool, 0444);
+MODULE_PARM_DESC(free_run, "Pad playback underruns with silence and keep the DMA running, ALSA's stop_threshold decides about the xrun (default: off)");
+
+static bool direct_copy;
+module_param(direct_copy, bool, 0444);
+MODULE_PARM_DESC(direct_copy, "Pack playback straight from the application into the DMA buffer, bypassing the ALSA buffer (default: off)");
 
-static struct snd_card *card;                           // Audio card struct
-static struct snd_pcm *pcm;                             // PCM device struct
-static struct dma_chan *dma_channel;                    // DMA Channel struct
-static void *dma_buffer;                                // The DMA buffer
-static dma_addr_t dma_handle;                           // Physical address for the DMA buffer
-static struct mutex dma_lock;                           // Mutex for non-atomic contexts
-static struct snd_pcm_substream *g_substream = NULL;    // PCM substream struct
-static size_t buffer_fill_level = 0;                    // The DMA buffer fill level
-static snd_pcm_uframes_t driver_hw_ptr = 0;             // Hrdware pointer of the module
+static bool sg;
+module_param(sg, bool, 0444);
+MODULE_PARM_DESC(sg, "Use scatter-gather buffers and descriptors instead of physically contiguous memory, not with cyclic (default: off)");
 
-// Declare a workqueue and a work struct to handle DMA completion outside interrupt context
-static struct work_struct dma_work;
-static bool work_pending = false;
+static int autosuspend_ms = 2000;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time after the last close before the DMA channels are released, -1 keeps them (default: 2000)");
+
+static bool noncoherent;
+module_param(noncoherent, bool, 0444);
+MODULE_PARM_DESC(noncoherent, "Pack into a cached DMA buffer that is synced per period instead of coherent memory, not with sg (default: off)");
+
+static bool native_format;
+module_param(native_format, bool, 0444);
+MODULE_PARM_DESC(native_format, "Offer the hardware-native 64-bit words as DSD_U32_BE, for applications that produce the hardware layout (default: off)");
+
+static char *playback_channel = "dma0chan0";
+module_param(playback_channel, charp, 0444);
+MODULE_PARM_DESC(playback_channel, "DMA channel of the playback stream without device tree, the MM2S channel of the AXI DMA (default: dma0chan0)");
+
+static char *capture_channel = "dma0chan1";
+module_param(capture_channel, charp, 0444);
+MODULE_PARM_DESC(capture_channel, "DMA channel of the capture stream without device tree, the S2MM channel of the AXI DMA, empty for no capture (default: dma0chan1)");
 
 // ALSA PCM hardware parameters
 static struct snd_pcm_hardware dma_pcm_hardware = {
-    .info = SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_BLOCK_TRANSFER,
-    .formats = SNDRV_PCM_FMTBIT_S24_3LE | SNDRV_PCM_FMTBIT_S24_LE,
-    .rates = SNDRV_PCM_RATE_48000,
+    .info = SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_BATCH |
+            SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID |
+            SNDRV_PCM_INFO_EXPLICIT_SYNC |  // The ALSA buffer is cached, mmap clients sync through the kernel
+            SNDRV_PCM_INFO_SYNC_APPLPTR |   // Every application pointer update reaches the ack callback
+            SNDRV_PCM_INFO_RESUME |         // Trigger resume queues the ring again from driver_hw_ptr
+            SNDRV_PCM_INFO_HAS_LINK_ATIME,  // Audio timestamps from the DMA completions, see dma_pcm_get_time_info()
+    .formats = SNDRV_PCM_FMTBIT_S24_3LE | SNDRV_PCM_FMTBIT_S24_LE | SNDRV_PCM_FMTBIT_S32_LE |
+               SNDRV_PCM_FMTBIT_S16_LE | DMA_PCM_FMTBIT_NATIVE, // The native format is removed at init unless native_format
+    .rates = SNDRV_PCM_RATE_48000,          // Replaced by the rates of the device at probe
     .rate_min = 48000,
     .rate_max = 48000,
     .channels_min = 2,
-    .channels_max = 2,
+    .channels_max = 2,                      // Replaced by the tdm_slots parameter at init
     .buffer_bytes_max = AUDIO_BUFFER_SIZE,
-    .period_bytes_min = 4096,
-    .period_bytes_max = 16384,
+    .period_bytes_min = DMA_PERIOD_BYTES_MIN,
+    .period_bytes_max = DMA_PERIOD_BYTES_MAX,
     .periods_min = 2,
-    .periods_max = 8,
+    .periods_max = DMA_MAX_PERIODS,
 };
 
 // DMA channel states
@@ -87,489 +276,3501 @@ enum dma_alsa_state {
     DMA_ALSA_STATE_STOPPED,
 };
 
-// Init DMA state
-static enum dma_alsa_state dma_state = DMA_ALSA_STATE_STOPPED;
+// Latency distribution of one measured interval
+struct dma_stat {
+    u64 count;
+    u64 sum_ns;
+    u64 min_ns;
+    u64 max_ns;
+    u32 hist[DMA_STATS_HIST_BUCKETS];
+};
+
+// Per-stream statistics, readable and resettable through debugfs
+struct dma_stream_stats {
+    struct dma_stat irq_to_work;                        // DMA completion callback to refill work
+    struct dma_stat pack;                               // Packing (unpacking for capture), scaled to 1 period
+    struct dma_stat submit_to_complete;                 // Period submitted (or packed in cyclic mode) to DMA completion
+    snd_pcm_sframes_t min_headroom;                     // Min frames the refill work saw before an xrun
+    unsigned long periods;                              // Periods completed
+    unsigned long xruns[DMA_XRUN_CAUSES];               // Underruns per cause
+    u64 complete_ns;                                    // Oldest completion not handled by the refill work yet
+    u64 submit_ns[DMA_MAX_PERIODS];                     // Submit time per ring slot
+};
+
+static struct dentry *dma_debugfs_root;                 // debugfs directory of the module, 1 subdirectory per device
+static struct platform_device *legacy_device;           // Device registered when no device tree node exists
+
+// Frame converters between the ALSA buffer and the packed 64-bit words, see the packers below
+typedef void (*dma_pack_fn)(uint64_t *dst, const uint8_t *src, snd_pcm_uframes_t frames);
+typedef void (*dma_unpack_fn)(uint8_t *dst, const uint64_t *src, snd_pcm_uframes_t frames);
+typedef uint32_t (*dma_sample_fn)(const uint8_t *src);
+typedef void (*dma_sample_write_fn)(uint8_t *dst, uint32_t sample);
+
+struct dma_stream;
+struct dma_alsa_chip;
+
+// One slot of the staging ring, the context of its one-shot descriptor
+struct dma_slot {
+    struct dma_stream *stream;
+    unsigned int index;
+    dma_cookie_t cookie;                                // Cookie of the one-shot descriptor of the slot
+    unsigned int periods;                               // Periods completed when its descriptor interrupts
+};
+
+// State of one PCM stream, playback runs on the MM2S channel and capture on the S2MM channel
+struct dma_stream {
+    struct dma_alsa_chip *chip;                         // Driver instance of the stream
+    const char *name;                                   // "playback" or "capture", for messages
+    int direction;                                      // SNDRV_PCM_STREAM_PLAYBACK or SNDRV_PCM_STREAM_CAPTURE
+    enum dma_transfer_direction dma_dir;                // DMA_MEM_TO_DEV or DMA_DEV_TO_MEM
+    struct dma_chan *dma_channel;                       // DMA Channel struct, NULL if the stream is not available
+    struct device *dma_dev;                             // DMA device of the first channel, referenced until remove
+    struct snd_dma_buffer dma_buffer;                   // The DMA buffer, kept from probe to remove
+    struct snd_pcm_substream *substream;                // PCM substream struct
+    snd_pcm_uframes_t driver_hw_ptr;                    // Hardware pointer of the module
+    u64 hw_ptr_frames;                                  // Frames driver_hw_ptr moved since the start, not wrapped
+    u64 done_periods;                                   // Periods the DMA completed since the start
+    ktime_t done_time;                                  // Time of the last DMA completion, or of the start
+    enum dma_alsa_state dma_state;                      // Read by the DMA callback, READ_ONCE / WRITE_ONCE
+    bool residue_pointer;                               // DMA engine reports the residue per burst
+    unsigned int max_seg_bytes;                         // Max length of one DMA segment of the channel
+
+    // Work items to handle DMA completion outside interrupt context
+    struct work_struct dma_work;
+    struct kthread_work dma_kwork;
+    atomic_t periods_completed;                         // Periods completed by the DMA, not yet handled
+
+    // Staging ring of packed periods inside dma_buffer (or the ALSA buffer for the native format)
+    void *ring_area;                                    // Virtual address of slot 0
+    struct snd_dma_buffer *ring_buf;                    // Buffer of the ring, slot 0 at its start
+    unsigned int ring_slots;                            // Number of packed periods in the ring
+    unsigned int ring_depth;                            // Max number of slots queued to the DMA
+    unsigned int ring_head;                             // Next ring slot to be packed (playback) or queued (capture)
+    unsigned int ring_queued;                           // Slots queued to the DMA and not completed yet
+    snd_pcm_uframes_t ring_packed;                      // Playback frames packed from ring_head on, not queued yet
+    size_t ring_period_bytes;                           // Size of one packed period in the ring
+    unsigned int ring_done_slot;                        // Last slot reported done by the DMA callback
+    unsigned int irq_interval;                          // Periods per interrupting one-shot descriptor
+    unsigned int irq_pending;                           // Periods queued since the last interrupting descriptor
+    struct dma_slot ring_slot[DMA_MAX_PERIODS];
+    struct scatterlist ring_sg[DMA_SG_MAX_ENTS];        // Pages of the slot being prepared in sg mode
+    dma_cookie_t cyclic_cookie;                         // Cookie of the cyclic descriptor
+    bool cyclic_armed;                                  // The cyclic descriptor is submitted, not issued yet
+    spinlock_t ring_lock;                               // Writer lock of ring_seq, the stream lock serializes the packing
+    seqcount_spinlock_t ring_seq;                       // Lock-free snapshot of the ring indices for the pointer callback
+    unsigned int cyclic_done_slot;                      // Next ring slot the cyclic descriptor completes
+
+    // Converters selected for the current hw_params
+    dma_pack_fn pack_frames;                            // Playback packer
+    dma_unpack_fn unpack_frames;                        // Capture unpacker
+    dma_sample_fn read_sample;                          // Sample reader when the slot layout is remapped
+    dma_sample_write_fn write_sample;                   // Sample writer when the slot layout is remapped
+    bool pack_remapped;                                 // Slots do not follow the ALSA channel order 1:1
+    bool direct;                                        // Packed by the copy callbacks into a ring laid out like the ALSA buffer
+    uint8_t copy_bounce[DMA_COPY_BOUNCE_BYTES];         // User data of the direct copy before it is packed
+
+    spinlock_t stats_lock;                              // Protects stats, taken from the DMA callback
+    struct dma_stream_stats stats;
+};
+
+// One instance of the driver: a sound card on the channels of 1 AXI DMA core
+struct dma_alsa_chip {
+    struct device *dev;                                 // Platform device of the instance
+    struct snd_card *card;                              // Audio card struct
+    struct snd_pcm *pcm;                                // PCM device struct
+    struct dma_stream streams[2];                       // Indexed by SNDRV_PCM_STREAM_PLAYBACK / _CAPTURE
+    struct snd_pcm_hardware hw;                         // dma_pcm_hardware with the rates of this instance
+    unsigned int rates[DMA_MAX_RATES];                  // From the device tree, or the rates parameter
+    struct snd_pcm_hw_constraint_list rate_constraint;
+
+    // Software volume of playback, applied while packing, the mixer controls are serialized by ALSA
+    unsigned int volume[DMA_MAX_TDM_SLOTS];             // Mixer volume per ALSA channel, DMA_VOLUME_MAX is 0 dB
+    bool volume_on[DMA_MAX_TDM_SLOTS];                  // Mixer switch per ALSA channel, off mutes the channel
+    u32 gain[DMA_MAX_TDM_SLOTS];                        // Gain per ALSA channel, read by the packer with READ_ONCE
+    bool gain_unity;                                    // Every channel at 0 dB, the format packers run unchanged
+
+    // Declare a workqueue to handle DMA completion outside interrupt context, the work items are per stream
+    struct workqueue_struct *dma_wq;                    // Dedicated workqueue, NULL for the system workqueue
+    struct kthread_worker *dma_kworker;                 // Real-time refill thread
+    struct dentry *debugfs_dir;
+};
 
 // Forward declaration of write_to_buffer so we can call it from work handler
-static void write_to_buffer(struct snd_pcm_substream *substream);
+static int write_to_buffer(struct dma_stream *s);
+static int read_from_buffer(struct dma_stream *s);
 
-// Workqueue handler - runs in process context, can use mutexes and call ALSA functions safely
-static void dma_work_handler(struct work_struct *work)
+/*
+ * Statistics
+ *
+ * Every interval is kept as count, min, max, sum and a log2 histogram in microseconds.
+ * The helpers are called from the DMA callback, the refill work and write_to_buffer()
+ */
+
+/* Reset all statistics, called at init and on a write to the debugfs file */
+static void dma_stats_reset(struct dma_stream *s)
 {
-    struct snd_pcm_runtime *runtime;
-    snd_pcm_sframes_t available_frames;
+    struct dma_stream_stats *stats = &s->stats;
+    unsigned long flags;
+
+    spin_lock_irqsave(&s->stats_lock, flags);
+    memset(stats, 0, sizeof(*stats));
+    stats->irq_to_work.min_ns = U64_MAX;
+    stats->pack.min_ns = U64_MAX;
+    stats->submit_to_complete.min_ns = U64_MAX;
+    stats->min_headroom = LONG_MAX;
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+}
+
+/* Add one measured interval, the stats_lock of its stream must be held */
+static void dma_stat_add(struct dma_stat *stat, u64 ns)
+{
+    unsigned int bucket = 0;
+
+    if (ns >= NSEC_PER_USEC)
+        bucket = min_t(unsigned int, ilog2(div_u64(ns, NSEC_PER_USEC)) + 1, DMA_STATS_HIST_BUCKETS - 1);
+
+    stat->count++;
+    stat->sum_ns += ns;
+    stat->min_ns = min(stat->min_ns, ns);
+    stat->max_ns = max(stat->max_ns, ns);
+    stat->hist[bucket]++;
+}
+
+/* A new stream starts, forget the timestamps of the previous one */
+static void dma_stats_prepare(struct dma_stream *s)
+{
+    struct dma_stream_stats *stats = &s->stats;
+    unsigned long flags;
+
+    spin_lock_irqsave(&s->stats_lock, flags);
+    memset(stats->submit_ns, 0, sizeof(stats->submit_ns));
+    stats->complete_ns = 0;
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+}
+
+/* A period was handed to the DMA, remember when */
+static void dma_stats_submit(struct dma_stream *s, unsigned int slot)
+{
+    struct dma_stream_stats *stats = &s->stats;
+    unsigned long flags;
+
+    spin_lock_irqsave(&s->stats_lock, flags);
+    stats->submit_ns[slot] = ktime_get_ns();
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+}
+
+/* The DMA completed the periods up to a slot, called from the DMA callback */
+static void dma_stats_complete(struct dma_stream *s, unsigned int slot, unsigned int periods)
+{
+    struct dma_stream_stats *stats = &s->stats;
+    unsigned long flags;
+    u64 now = ktime_get_ns();
+
+    spin_lock_irqsave(&s->stats_lock, flags);
+    stats->periods += periods;
+    if (stats->submit_ns[slot]) {
+        dma_stat_add(&stats->submit_to_complete, now - stats->submit_ns[slot]);
+        stats->submit_ns[slot] = 0;
+    }
+    // Completions coalesced into one run of the refill work are measured from the first one
+    if (!stats->complete_ns)
+        stats->complete_ns = now;
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+}
+
+/* The refill work started, with headroom frames left before an xrun */
+static void dma_stats_work_start(struct dma_stream *s, snd_pcm_sframes_t headroom)
+{
+    struct dma_stream_stats *stats = &s->stats;
+    unsigned long flags;
+    u64 now = ktime_get_ns();
+
+    spin_lock_irqsave(&s->stats_lock, flags);
+    if (stats->complete_ns) {
+        dma_stat_add(&stats->irq_to_work, now - stats->complete_ns);
+        stats->complete_ns = 0;
+    }
+    stats->min_headroom = min(stats->min_headroom, headroom);
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+}
+
+/* frames were packed in ns nanoseconds, recorded as the time of 1 period at that speed */
+static void dma_stats_pack(struct dma_stream *s, u64 ns, snd_pcm_uframes_t frames, snd_pcm_uframes_t period)
+{
+    struct dma_stream_stats *stats = &s->stats;
+    unsigned long flags;
+
+    // The ack packs whatever the application committed, the runs are scaled to 1 period to stay comparable
+    if (frames && frames != period)
+        ns = div64_u64(ns * period, frames);
 
-    if (!g_substream)
+    spin_lock_irqsave(&s->stats_lock, flags);
+    dma_stat_add(&stats->pack, ns);
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+}
+
+/* An xrun stops the stream, count and trace it with its cause */
+static void dma_stats_xrun(struct dma_stream *s, int cause, snd_pcm_sframes_t ready)
+{
+    unsigned long flags;
+
+    trace_dma_alsa_xrun(s->direction, cause, s->driver_hw_ptr, ready);
+
+    spin_lock_irqsave(&s->stats_lock, flags);
+    s->stats.xruns[cause]++;
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+}
+
+/* The native format is transferred straight from the ALSA buffer */
+static bool dma_format_is_native(snd_pcm_format_t format)
+{
+    // Without native_format the DSD container is an unsupported format like any other
+    return native_format && format == DMA_PCM_FORMAT_NATIVE;
+}
+
+/* The ring slots are the periods of the ALSA buffer, in the same positions */
+static bool dma_ring_in_place(struct dma_stream *s, struct snd_pcm_runtime *runtime)
+{
+    return s->direct || dma_format_is_native(runtime->format);
+}
+
+/* Stream of a substream */
+static struct dma_stream *dma_stream_of(struct snd_pcm_substream *substream)
+{
+    struct dma_alsa_chip *chip = snd_pcm_substream_chip(substream);
+
+    return &chip->streams[substream->stream];
+}
+
+/* Frames committed by the application ahead of the driver hardware pointer */
+static snd_pcm_sframes_t dma_frames_ready(struct dma_stream *s)
+{
+    /*
+    ALSA's own hw_ptr is synced to the pointer callback, which may be ahead of
+    driver_hw_ptr within the queued periods when the DMA residue is used.
+    The distance to appl_ptr plus that offset is what the driver can still consume
+    */
+
+    struct snd_pcm_runtime *runtime = s->substream->runtime;
+    snd_pcm_sframes_t ready = snd_pcm_playback_hw_avail(runtime);
+
+    ready += (runtime->status->hw_ptr % runtime->buffer_size + runtime->buffer_size - s->driver_hw_ptr) %
+             runtime->buffer_size;
+
+    return ready < 0 ? 0 : ready;
+}
+
+/* Frames left before the stream runs into an xrun */
+static snd_pcm_sframes_t dma_headroom(struct dma_stream *s)
+{
+    // Playback starves when the committed frames run out, capture overruns when the buffer is full
+    if (s->direction == SNDRV_PCM_STREAM_CAPTURE)
+        return snd_pcm_capture_hw_avail(s->substream->runtime);
+
+    return dma_frames_ready(s);
+}
+
+/* Copy the captured periods from their ring slots into the ALSA buffer */
+static void unpack_captured(struct dma_stream *s, unsigned int completed);
+
+// Refill handler - runs with the stream lock held, the only writer of the ring indices while the stream runs
+static void dma_refill_locked(struct dma_stream *s)
+{
+    struct snd_pcm_runtime *runtime = s->substream->runtime;
+    unsigned int completed;
+    unsigned int last_slot;
+    unsigned long flags;
+    enum dma_alsa_state state = READ_ONCE(s->dma_state);
+
+    // The pending bit of the work is already cleared, completions from now on queue the next run
+    completed = atomic_xchg(&s->periods_completed, 0);
+
+    // Work queued before a stop runs after it, its completions belong to the stopped stream
+    if (state != DMA_ALSA_STATE_RUNNING && state != DMA_ALSA_STATE_RECOVERING)
+        return;
+    if (!completed)
         return;
 
-    runtime = g_substream->runtime;
+    trace_dma_alsa_work_start(s->direction, completed, s->driver_hw_ptr, s->ring_queued);
+    dma_stats_work_start(s, dma_headroom(s));
+
+    // First, inform ALSA that the completed periods have elapsed
+    // The refill is the only writer of the ring indices while the stream runs, trigger start comes before it
+    // A free-running cyclic engine may have played slots that were never queued, they count as played,
+    // only the frames packed into those slots are gone, the ones packed beyond them stay
+    if (free_run && cyclic && s->direction == SNDRV_PCM_STREAM_PLAYBACK && completed > s->ring_queued) {
+        spin_lock_irqsave(&s->ring_lock, flags);
+        write_seqcount_begin(&s->ring_seq);
+        s->ring_packed -= min_t(snd_pcm_uframes_t, s->ring_packed,
+                                (completed - s->ring_queued) * runtime->period_size);
+        s->ring_head = (s->ring_head + completed - s->ring_queued) % s->ring_slots;
+        s->ring_queued = completed;
+        write_seqcount_end(&s->ring_seq);
+        spin_unlock_irqrestore(&s->ring_lock, flags);
+    }
+
+    completed = min(completed, s->ring_queued);
+
+    // Completions arrive in ring order, the last one must match the slot reported by the callback
+    last_slot = (s->ring_head + s->ring_slots - s->ring_queued + completed - 1) % s->ring_slots;
+    if (!cyclic && completed && last_slot != READ_ONCE(s->ring_done_slot))
+        pr_warn_ratelimited("dma-alsa: %s dma completed slot %u, expected slot %u\n", s->name,
+                READ_ONCE(s->ring_done_slot), last_slot);
+
+    // Captured data has to be in the ALSA buffer before the hardware pointer moves past it
+    if (s->direction == SNDRV_PCM_STREAM_CAPTURE)
+        unpack_captured(s, completed);
+
+    spin_lock_irqsave(&s->ring_lock, flags);
+    write_seqcount_begin(&s->ring_seq);
+    s->ring_queued -= completed;
+    s->driver_hw_ptr = (s->driver_hw_ptr + completed * runtime->period_size) % runtime->buffer_size;
+    s->hw_ptr_frames += completed * runtime->period_size;
+    write_seqcount_end(&s->ring_seq);
+    spin_unlock_irqrestore(&s->ring_lock, flags);
+
+    snd_pcm_period_elapsed_under_stream_lock(s->substream);
+
+    if (s->direction == SNDRV_PCM_STREAM_CAPTURE) {
+        // ALSA stops the stream itself when the application does not read in time
+        if (runtime->status->state == SNDRV_PCM_STATE_XRUN) {
+            dma_stats_xrun(s, DMA_XRUN_OVERRUN, snd_pcm_capture_avail(runtime));
+            WRITE_ONCE(s->dma_state, DMA_ALSA_STATE_RECOVERING);
+            return;
+        }
 
-    // First, inform ALSA that a period has elapsed
-    driver_hw_ptr = (driver_hw_ptr + runtime->period_size) % runtime->buffer_size;
-    snd_pcm_period_elapsed(g_substream);
+        // Hand the emptied slots back to the DMA, a failed submission stops the stream like an overrun
+        if (read_from_buffer(s))
+            snd_pcm_stop(s->substream, SNDRV_PCM_STATE_XRUN);
 
-    // Check if there is another period available
-    available_frames = runtime->control->appl_ptr - driver_hw_ptr;
-    if (available_frames < 0)
-        // Compensate for the circular ALSA buffer
-        available_frames += runtime->buffer_size;
+        trace_dma_alsa_work_end(s->direction, s->driver_hw_ptr, s->ring_queued, dma_headroom(s));
+        return;
+    }
 
-    if (available_frames < (snd_pcm_sframes_t)runtime->period_size) {
+    // Check if the hardware still has a packed period to play or if another period is available
+    // Free-running, write_to_buffer() pads the ring with silence instead
+    if (!free_run && !s->ring_queued && (cyclic || dma_frames_ready(s) < (snd_pcm_sframes_t)runtime->period_size)) {
         // Not enough data for next period -> UNDERRUN
 
         /* 
         * Underrun is highly unwanted because ALSA has to recover from it and
         * a drop in the audio stream may be observed.
+        * In cyclic mode the engine is already playing a slot that was never packed.
         */
 
-        pr_info("dma-alsa: underrun detected in work handler\n");
-        snd_pcm_stop_xrun(g_substream);
-        dma_state = DMA_ALSA_STATE_RECOVERING;
+        dma_stats_xrun(s, cyclic ? DMA_XRUN_RING_DRAINED : DMA_XRUN_NO_DATA, dma_frames_ready(s));
+        snd_pcm_stop(s->substream, SNDRV_PCM_STATE_XRUN);
+        WRITE_ONCE(s->dma_state, DMA_ALSA_STATE_RECOVERING);
+        return;
+    }
+
+    // If we have enough data, load the next periods
+    // This will copy data, zero-pad it, and start a new DMA transfer in one-shot/pipelined mode
+    // A failed submission stops the stream like an underrun
+    if (write_to_buffer(s))
+        snd_pcm_stop(s->substream, SNDRV_PCM_STATE_XRUN);
+
+    trace_dma_alsa_work_end(s->direction, s->driver_hw_ptr, s->ring_queued, dma_frames_ready(s));
+}
+
+/* Run the refill of a stream under its stream lock */
+static void dma_refill(struct dma_stream *s)
+{
+    /*
+    This function is executed by the refill work, or by the DMA callback with refill_mode=4
+        The stream lock serializes the refill with trigger, the ack callback and the ALSA pointer updates,
+        so the period is reported and an xrun stops the stream without dropping the lock in between
+        The PCM is nonatomic unless the refill runs in the DMA callback, the stream lock is a mutex then
+        Nothing in the refill sleeps, it runs in atomic context as well
+    */
+
+    struct snd_pcm_substream *substream = READ_ONCE(s->substream);
+    unsigned long flags;
+
+    if (!substream)
         return;
+
+    snd_pcm_stream_lock_irqsave(substream, flags);
+    dma_refill_locked(s);
+    snd_pcm_stream_unlock_irqrestore(substream, flags);
+}
+
+// Workqueue handler for the system and dedicated workqueues
+static void dma_work_handler(struct work_struct *work)
+{
+    dma_refill(container_of(work, struct dma_stream, dma_work));
+}
+
+// Kthread worker handler for the real-time refill thread
+static void dma_kwork_handler(struct kthread_work *work)
+{
+    dma_refill(container_of(work, struct dma_stream, dma_kwork));
+}
+
+/* Queue the refill work of a stream in the context selected by refill_mode */
+static void dma_queue_refill(struct dma_stream *s)
+{
+    /*
+    This function is executed from the DMA callback (atomic context)
+    Queueing is idempotent: the pending bit of the work item is tested and set atomically,
+    so no extra flag is needed and a completion during a running refill queues a new run
+    */
+
+    switch (refill_mode) {
+    case DMA_REFILL_HIGHPRI_WQ:
+        queue_work(s->chip->dma_wq, &s->dma_work);
+        break;
+    case DMA_REFILL_CPU_WQ:
+        queue_work_on(refill_cpu, s->chip->dma_wq, &s->dma_work);
+        break;
+    case DMA_REFILL_RT_KTHREAD:
+        kthread_queue_work(s->chip->dma_kworker, &s->dma_kwork);
+        break;
+    default:
+        schedule_work(&s->dma_work);
+        break;
+    }
+}
+
+/* Set up the execution context of the refill work */
+static int init_refill_context(struct dma_alsa_chip *chip)
+{
+    /*
+    This function is part of the probe of a device to create the refill context
+        A dedicated workqueue or real-time kthread worker is created depending on refill_mode
+        It is shared by the playback and capture work items of the device,
+        every device has its own so instances complete in parallel
+    */
+
+    struct kthread_worker *worker;
+
+    switch (refill_mode) {
+    case DMA_REFILL_SYSTEM_WQ:
+        break;
+
+    case DMA_REFILL_HIGHPRI_WQ:
+        chip->dma_wq = alloc_workqueue("dma-alsa-%s", WQ_HIGHPRI | WQ_UNBOUND, 1, dev_name(chip->dev));
+        if (!chip->dma_wq)
+            return -ENOMEM;
+        break;
+
+    case DMA_REFILL_CPU_WQ:
+        if (refill_cpu >= nr_cpu_ids || !cpu_online(refill_cpu)) {
+            pr_err("dma-alsa: refill_cpu %u is not online\n", refill_cpu);
+            return -EINVAL;
+        }
+        chip->dma_wq = alloc_workqueue("dma-alsa-%s", WQ_HIGHPRI, 1, dev_name(chip->dev));
+        if (!chip->dma_wq)
+            return -ENOMEM;
+        break;
+
+    case DMA_REFILL_CALLBACK:
+        break;
+
+    case DMA_REFILL_RT_KTHREAD:
+        worker = kthread_create_worker(0, "dma-alsa/%s", dev_name(chip->dev));
+        if (IS_ERR(worker)) {
+            pr_err("dma-alsa: could not create the refill thread\n");
+            return PTR_ERR(worker);
+        }
+        sched_set_fifo(worker->task);
+        chip->dma_kworker = worker;
+        break;
+
+    default:
+        pr_err("dma-alsa: unsupported refill_mode: %u\n", refill_mode);
+        return -EINVAL;
+    }
+
+    pr_info("dma-alsa: refill context initialized, mode %u\n", refill_mode);
+    return 0;
+}
+
+/* Flush and release the execution context of the refill work */
+static void exit_refill_context(struct dma_alsa_chip *chip)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(chip->streams); i++) {
+        if (chip->dma_kworker)
+            kthread_flush_work(&chip->streams[i].dma_kwork);
+        flush_work(&chip->streams[i].dma_work);
+    }
+
+    if (chip->dma_kworker) {
+        kthread_destroy_worker(chip->dma_kworker);
+        chip->dma_kworker = NULL;
     }
 
-    // If we have enough data, load next period
-    // This will copy data, zero-pad it, and start a new DMA transfer
-    write_to_buffer(g_substream);
+    if (chip->dma_wq) {
+        destroy_workqueue(chip->dma_wq);
+        chip->dma_wq = NULL;
+    }
+}
 
-    work_pending = false; 
+/* Count completed periods and queue the refill work (or refill right away), called in interrupt context */
+static void dma_period_done(struct dma_stream *s, unsigned int slot, unsigned int periods)
+{
+    enum dma_alsa_state state = READ_ONCE(s->dma_state);
+    ktime_t now = ktime_get();
+    unsigned long flags;
+
+    dma_stats_complete(s, slot, periods);
+
+    if (state == DMA_ALSA_STATE_RUNNING || state == DMA_ALSA_STATE_RECOVERING) {
+        // The completion time is the audio timestamp of the position, taken before the refill delay
+        spin_lock_irqsave(&s->ring_lock, flags);
+        write_seqcount_begin(&s->ring_seq);
+        s->done_periods += periods;
+        s->done_time = now;
+        write_seqcount_end(&s->ring_seq);
+        spin_unlock_irqrestore(&s->ring_lock, flags);
+
+        // Every completion is counted, so periods are not lost when the work is already pending
+        atomic_add(periods, &s->periods_completed);
+        if (refill_mode == DMA_REFILL_CALLBACK)
+            dma_refill(s);
+        else
+            dma_queue_refill(s);
+    }
 }
 
-/* DMA completed callback */
-static void dma_transfer_callback(void *completion)
+/* DMA completed callback of a one-shot descriptor */
+static void dma_transfer_callback(void *param)
 {
     /*
     This callback is executed in interrupt (atomic) context. 
     We must not use mutex or ALSA calls that can sleep here.
-    Instead, we schedule our workqueue task.
+    Instead, we queue our refill work.
     */
 
+    struct dma_slot *slot = param;
+    struct dma_stream *s = slot->stream;
+
     // Minimal work here for performance reasons: just schedule the work
-    pr_info("dma-alsa: dma transfer completed (interrupt handler), scheduling work\n");
+    trace_dma_alsa_complete(s->direction, slot->index, atomic_read(&s->periods_completed));
+
+    // One-shot descriptors carry the ring slot they transferred,
+    // the descriptors queued before it without interrupt completed in order before it
+    WRITE_ONCE(s->ring_done_slot, slot->index);
+    dma_period_done(s, slot->index, slot->periods);
+}
+
+/* DMA completed callback of the cyclic descriptor, once per period */
+static void dma_cyclic_callback(void *param)
+{
+    struct dma_stream *s = param;
+    unsigned int slot = s->cyclic_done_slot;
+
+    trace_dma_alsa_complete(s->direction, -1, atomic_read(&s->periods_completed));
+
+    // The cyclic descriptor completes the slots in ring order, starting from slot 0
+    s->cyclic_done_slot = (slot + 1) % s->ring_slots;
+    dma_period_done(s, slot, 1);
+}
+
+/* dma_request_channel() filter: match the channel by name */
+static bool dma_filter_by_name(struct dma_chan *chan, void *param)
+{
+    return !strcmp(dma_chan_name(chan), param);
+}
+
+/* Initialize the DMA channel of a stream */
+static int init_dma_channel(struct dma_stream *s, const char *dt_name, const char *name)
+{
+    /*
+    This function is part of the probe of a device to init the dma channel
+        With a device tree node the channel is taken from its dmas / dma-names properties,
+        a missing channel returns -ENODEV and a channel not probed yet -EPROBE_DEFER
+        Without one the channel is requested by name, this module uses the channel to AXI DMA in hardware
+        The channel has to support the direction of the stream
+        The residue granularity of the channel is checked for the pointer callback
+        The max segment size of the channel is kept for the period size constraint
+    */
+
+    struct dma_slave_caps caps;
+    dma_cap_mask_t mask;
+    struct device *dev = s->chip->dev;
+
+    if (dev_of_node(dev)) {
+        s->dma_channel = dma_request_chan(dev, dt_name);
+        if (IS_ERR(s->dma_channel)) {
+            int err = PTR_ERR(s->dma_channel);
+
+            s->dma_channel = NULL;
+            if (err != -EPROBE_DEFER)
+                pr_err("dma-alsa: %s: couldnt request the %s dma channel %s: %d\n", dev_name(dev), s->name, dt_name, err);
+            return err;
+        }
+        name = dt_name;
+    } else {
+        dma_cap_zero(mask);
+        dma_cap_set(DMA_SLAVE|DMA_PRIVATE, mask);
+        s->dma_channel = dma_request_channel(mask, dma_filter_by_name, (void *)name);
+        if (IS_ERR_OR_NULL(s->dma_channel)) {
+            pr_err("dma-alsa: couldnt request the %s dma channel %s\n", s->name, name);
+            s->dma_channel = NULL;
+            return -ENODEV;
+        }
+    }
+
+    pr_debug("dma-alsa: %s dma channel obtained: %s\n", s->name, s->dma_channel->device->dev->kobj.name);
 
-    // To avoid queueing multiple works before handling, check a flag
-    if (dma_state == DMA_ALSA_STATE_RUNNING || dma_state == DMA_ALSA_STATE_RECOVERING) {
-        if (!work_pending) {
-            work_pending = true;
-            schedule_work(&dma_work);
+    if (!dma_get_slave_caps(s->dma_channel, &caps)) {
+        if (!(caps.directions & BIT(s->dma_dir))) {
+            pr_err("dma-alsa: dma channel %s does not support %s\n", name, s->name);
+            dma_release_channel(s->dma_channel);
+            s->dma_channel = NULL;
+            return -EINVAL;
         }
+
+        // A residue updated per burst gives a pointer with sub-period granularity,
+        // a segment residue only moves per period here, a contiguous period is 1 segment
+        s->residue_pointer = caps.residue_granularity == DMA_RESIDUE_GRANULARITY_BURST;
+        if (s->residue_pointer) {
+            pr_debug("dma-alsa: dma residue available, reporting sub-period hw_ptr\n");
+        }
+    }
+
+    // A contiguous period is transferred in 1 segment, its size limits the period size
+    s->max_seg_bytes = dma_get_max_seg_size(s->dma_channel->device->dev);
+
+    // The buffers are allocated from the DMA device and outlive the channel released while the device is idle
+    if (!s->dma_dev)
+        s->dma_dev = get_device(s->dma_channel->device->dev);
+
+    return 0;
+}
+
+/* Request the DMA channel of a stream by the names of the device tree or the module parameters */
+static int request_stream_channel(struct dma_stream *s)
+{
+    if (s->direction == SNDRV_PCM_STREAM_CAPTURE)
+        return init_dma_channel(s, "rx", capture_channel);
+
+    return init_dma_channel(s, "tx", playback_channel);
+}
+
+/* Prepare a one-shot descriptor over len bytes of the ring from offset on */
+static struct dma_async_tx_descriptor *dma_prep_ring(struct dma_stream *s, size_t offset, size_t len,
+                                                     unsigned long flags)
+{
+    /*
+    This function is executed in start_dma_transfer(), by the only writer of the ring
+        A contiguous ring is transferred from its DMA address
+        In sg mode the pages of the range are collected into a scatterlist, pages that are
+        contiguous in bus address space are merged into 1 entry by the ALSA buffer helpers,
+        up to the max segment size of the channel
+    */
+
+    unsigned int chunk;
+    unsigned int n;
+
+    if (!sg)
+        return dmaengine_prep_slave_single(s->dma_channel, s->ring_buf->addr + offset, len, s->dma_dir, flags);
+
+    sg_init_table(s->ring_sg, DMA_SG_MAX_ENTS);
+    for (n = 0; len; n++) {
+        if (n == DMA_SG_MAX_ENTS) {
+            pr_err("dma-alsa: period of the %s ring spans more than %lu pages\n", s->name, DMA_SG_MAX_ENTS);
+            return NULL;
+        }
+
+        chunk = snd_sgbuf_get_chunk_size(s->ring_buf, offset, min_t(size_t, len, s->max_seg_bytes));
+        sg_dma_address(&s->ring_sg[n]) = snd_sgbuf_get_addr(s->ring_buf, offset);
+        sg_dma_len(&s->ring_sg[n]) = chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    sg_mark_end(&s->ring_sg[n - 1]);
+
+    return dmaengine_prep_slave_sg(s->dma_channel, s->ring_sg, n, s->dma_dir, flags);
+}
+
+/* Function to start the DMA transfer */
+static int start_dma_transfer(struct dma_stream *s, size_t len, size_t offset, unsigned int slot, bool last)
+{
+    /*
+    This function is executed in write_to_buffer() and read_from_buffer() to start a dma transfer
+        A descriptor for the transfer of the ring slot at offset is configured
+        Only every irq_interval-th descriptor and the last one queued for now interrupt,
+        the callback for completion of the transfer receives the ring slot and the periods it completes
+        The descriptor is queued behind the ones already in flight,
+        the engine is kicked once with the last descriptor of a refill, so a prefill starts as one chain
+    */
+
+    struct dma_async_tx_descriptor *desc;
+    dma_cookie_t cookie;
+    bool irq;
+
+    if (!s->dma_channel) {
+        pr_err("dma-alsa: dma_channel is NULL, cannot start transfer\n");
+        return -EINVAL;
+    }
+
+    // Without an interrupt the period is reported by the next descriptor that has one
+    irq = last || s->irq_pending + 1 >= s->irq_interval;
+
+    desc = dma_prep_ring(s, offset, len, irq ? DMA_PREP_INTERRUPT : 0);
+    if (!desc) {
+        pr_err("dma-alsa: could not prepare the dma descriptor\n");
+        return -EINVAL;
+    }
+
+    if (irq) {
+        desc->callback = dma_transfer_callback;
+        desc->callback_param = &s->ring_slot[slot];
+        s->ring_slot[slot].periods = s->irq_pending + 1;
+        s->irq_pending = 0;
+    } else {
+        s->irq_pending++;
+    }
+
+    cookie = dmaengine_submit(desc);
+    if (dma_submit_error(cookie)) {
+        pr_err("dma-alsa: dma transfer submission failed\n");
+        return -EINVAL;
+    }
+    s->ring_slot[slot].cookie = cookie;
+
+    if (last)
+        dma_async_issue_pending(s->dma_channel);
+
+    return 0;
+}
+
+/* Function to arm the cyclic DMA transfer over the staging ring */
+static int arm_dma_cyclic(struct dma_stream *s, dma_addr_t phys_addr, size_t ring_len, size_t period_len)
+{
+    /*
+    This function is executed at prepare when the module runs in cyclic mode
+        One cyclic descriptor is configured over the whole ring of packed periods and submitted,
+        trigger start only has to issue it
+        The engine raises the completion callback after every period and wraps around
+        without ever going idle, the work handler refills the slots behind the hardware
+    */
+
+    struct dma_async_tx_descriptor *desc;
+    dma_cookie_t cookie;
+
+    if (!s->dma_channel) {
+        pr_err("dma-alsa: dma_channel is NULL, cannot start cyclic transfer\n");
+        return -EINVAL;
     }
+
+    desc = dmaengine_prep_dma_cyclic(s->dma_channel, phys_addr, ring_len, period_len,
+                                     s->dma_dir, DMA_PREP_INTERRUPT);
+    if (!desc) {
+        pr_err("dma-alsa: could not prepare the cyclic dma descriptor\n");
+        return -EINVAL;
+    }
+
+    desc->callback = dma_cyclic_callback;
+    desc->callback_param = s;
+
+    cookie = dmaengine_submit(desc);
+    if (dma_submit_error(cookie)) {
+        pr_err("dma-alsa: cyclic dma transfer submission failed\n");
+        return -EINVAL;
+    }
+    s->cyclic_cookie = cookie;
+    s->cyclic_armed = true;
+
+    pr_debug("dma-alsa: cyclic %s dma transfer armed, ring length: %zu bytes, period length: %zu bytes\n",
+            s->name, ring_len, period_len);
+    return 0;
+}
+
+/*
+ * Frame packers
+ *
+ * Every packer converts a run of interleaved sample pairs into packed 64-bit words:
+ * the 3 bytes of the first (left) sample followed by the 3 bytes of the second (right)
+ * sample, in source byte order from the most significant byte down, and 16 zero bits.
+ * A pair is a stereo frame or 2 consecutive channels of a wider frame, so a frame in
+ * the default slot layout takes channels / 2 pairs.
+ * The packer for the negotiated format is selected once in hw_params.
+ */
+
+/* S24_3LE: one 32-bit and one 16-bit load per frame, the byte order is fixed with one byteswap */
+static void pack_s24_3le(uint64_t *dst, const uint8_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, src += 6) {
+        uint64_t lr = get_unaligned_le32(src) | ((uint64_t)get_unaligned_le16(src + 4) << 32);
+
+        dst[i] = swab64(lr);
+    }
+}
+
+/* S24_LE: two 32-bit loads per frame, the unused top byte of each container is masked off */
+static void pack_s24_le(uint64_t *dst, const uint8_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, src += 8) {
+        uint64_t lr = (get_unaligned_le32(src) & 0xffffff) |
+                      ((uint64_t)(get_unaligned_le32(src + 4) & 0xffffff) << 24);
+
+        dst[i] = swab64(lr);
+    }
+}
+
+/* S32_LE: the sample is truncated to its 24 most significant bits */
+static void pack_s32_le(uint64_t *dst, const uint8_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, src += 8) {
+        uint64_t lr = (get_unaligned_le32(src) >> 8) |
+                      ((uint64_t)(get_unaligned_le32(src + 4) >> 8) << 24);
+
+        dst[i] = swab64(lr);
+    }
+}
+
+/* S16_LE: the sample is shifted into the 16 most significant bits of the 24-bit slot */
+static void pack_s16_le(uint64_t *dst, const uint8_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, src += 4) {
+        uint64_t lr = ((uint32_t)get_unaligned_le16(src) << 8) |
+                      ((uint64_t)get_unaligned_le16(src + 2) << 32);
+
+        dst[i] = swab64(lr);
+    }
+}
+
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON) && !defined(CONFIG_CPU_BIG_ENDIAN)
+#define DMA_HAVE_NEON_PACKERS
+#define DMA_NEON_BLOCK_FRAMES 8             // Frames per NEON iteration
+
+/*
+ * TBL indices of 4 output vectors (2 words each) for a block of 8 frames,
+ * 0xff selects a zero byte. Word byte k (little endian) takes source byte
+ * {-, -, 5, 4, 3, 2, 1, 0}[k] for S24_3LE, {-, -, 6, 5, 4, 2, 1, 0}[k] for S24_LE,
+ * {-, -, 7, 6, 5, 3, 2, 1}[k] for S32_LE and {-, -, 3, 2, -, 1, 0, -}[k] for S16_LE.
+ */
+static const uint8_t neon_idx_s24_3le[64] = {
+    0xff, 0xff,  5,  4,  3,  2,  1,  0,  0xff, 0xff, 11, 10,  9,  8,  7,  6,
+    0xff, 0xff, 17, 16, 15, 14, 13, 12,  0xff, 0xff, 23, 22, 21, 20, 19, 18,
+    0xff, 0xff, 29, 28, 27, 26, 25, 24,  0xff, 0xff, 35, 34, 33, 32, 31, 30,
+    0xff, 0xff, 41, 40, 39, 38, 37, 36,  0xff, 0xff, 47, 46, 45, 44, 43, 42,
+};
+
+static const uint8_t neon_idx_s24_le[64] = {
+    0xff, 0xff,  6,  5,  4,  2,  1,  0,  0xff, 0xff, 14, 13, 12, 10,  9,  8,
+    0xff, 0xff, 22, 21, 20, 18, 17, 16,  0xff, 0xff, 30, 29, 28, 26, 25, 24,
+    0xff, 0xff, 38, 37, 36, 34, 33, 32,  0xff, 0xff, 46, 45, 44, 42, 41, 40,
+    0xff, 0xff, 54, 53, 52, 50, 49, 48,  0xff, 0xff, 62, 61, 60, 58, 57, 56,
+};
+
+static const uint8_t neon_idx_s32_le[64] = {
+    0xff, 0xff,  7,  6,  5,  3,  2,  1,  0xff, 0xff, 15, 14, 13, 11, 10,  9,
+    0xff, 0xff, 23, 22, 21, 19, 18, 17,  0xff, 0xff, 31, 30, 29, 27, 26, 25,
+    0xff, 0xff, 39, 38, 37, 35, 34, 33,  0xff, 0xff, 47, 46, 45, 43, 42, 41,
+    0xff, 0xff, 55, 54, 53, 51, 50, 49,  0xff, 0xff, 63, 62, 61, 59, 58, 57,
+};
+
+static const uint8_t neon_idx_s16_le[64] = {
+    0xff, 0xff,  3,  2, 0xff,  1,  0, 0xff,  0xff, 0xff,  7,  6, 0xff,  5,  4, 0xff,
+    0xff, 0xff, 11, 10, 0xff,  9,  8, 0xff,  0xff, 0xff, 15, 14, 0xff, 13, 12, 0xff,
+    0xff, 0xff, 19, 18, 0xff, 17, 16, 0xff,  0xff, 0xff, 23, 22, 0xff, 21, 20, 0xff,
+    0xff, 0xff, 27, 26, 0xff, 25, 24, 0xff,  0xff, 0xff, 31, 30, 0xff, 29, 28, 0xff,
+};
+
+/*
+ * NEON packer body: load one block of 8 frames (in_regs source vectors), shuffle it into
+ * 4 output vectors with TBL and store them, the remaining frames go to the scalar packer
+ */
+#define DMA_NEON_PACKER(name, in_regs, in_bytes, idx, scalar)                            \
+static void name(uint64_t *dst, const uint8_t *src, snd_pcm_uframes_t frames)            \
+{                                                                                        \
+    unsigned long blocks = frames / DMA_NEON_BLOCK_FRAMES;                               \
+                                                                                         \
+    if (blocks && may_use_simd()) {                                                      \
+        kernel_neon_begin();                                                             \
+        asm volatile(                                                                    \
+            "   ld1     {v4.16b-v7.16b}, [%[tbl]]\n"                                     \
+            "1: ld1     {" in_regs "}, [%[src]], #" __stringify(in_bytes) "\n"           \
+            "   tbl     v16.16b, {" in_regs "}, v4.16b\n"                                \
+            "   tbl     v17.16b, {" in_regs "}, v5.16b\n"                                \
+            "   tbl     v18.16b, {" in_regs "}, v6.16b\n"                                \
+            "   tbl     v19.16b, {" in_regs "}, v7.16b\n"                                \
+            "   st1     {v16.16b-v19.16b}, [%[dst]], #64\n"                              \
+            "   subs    %[blocks], %[blocks], #1\n"                                      \
+            "   b.ne    1b\n"                                                            \
+            : [src] "+r" (src), [dst] "+r" (dst), [blocks] "+r" (blocks)                 \
+            : [tbl] "r" (idx)                                                            \
+            : "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",                            \
+              "v16", "v17", "v18", "v19", "cc", "memory");                               \
+        kernel_neon_end();                                                               \
+        frames %= DMA_NEON_BLOCK_FRAMES;                                                 \
+    }                                                                                    \
+                                                                                         \
+    scalar(dst, src, frames);                                                            \
+}
+
+DMA_NEON_PACKER(pack_s24_3le_neon, "v0.16b-v2.16b", 48, neon_idx_s24_3le, pack_s24_3le)
+DMA_NEON_PACKER(pack_s24_le_neon, "v0.16b-v3.16b", 64, neon_idx_s24_le, pack_s24_le)
+DMA_NEON_PACKER(pack_s32_le_neon, "v0.16b-v3.16b", 64, neon_idx_s32_le, pack_s32_le)
+DMA_NEON_PACKER(pack_s16_le_neon, "v0.16b-v1.16b", 32, neon_idx_s16_le, pack_s16_le)
+#endif
+
+/*
+ * Sample readers for the remapped slot layout: return the 24 most significant bits of
+ * one sample, least significant byte first, as the pair packers place them in a slot
+ */
+
+static uint32_t read_s24_3le(const uint8_t *src)
+{
+    return get_unaligned_le16(src) | ((uint32_t)src[2] << 16);
+}
+
+static uint32_t read_s24_le(const uint8_t *src)
+{
+    return get_unaligned_le32(src) & 0xffffff;
+}
+
+static uint32_t read_s32_le(const uint8_t *src)
+{
+    return get_unaligned_le32(src) >> 8;
+}
+
+static uint32_t read_s16_le(const uint8_t *src)
+{
+    return (uint32_t)get_unaligned_le16(src) << 8;
+}
+
+/* Select the sample reader for a sample format, NULL if the format is not packed by the CPU */
+static dma_sample_fn select_sample_reader(snd_pcm_format_t format)
+{
+    switch (format) {
+    case SNDRV_PCM_FORMAT_S24_3LE:
+        return read_s24_3le;
+    case SNDRV_PCM_FORMAT_S24_LE:
+        return read_s24_le;
+    case SNDRV_PCM_FORMAT_S32_LE:
+        return read_s32_le;
+    case SNDRV_PCM_FORMAT_S16_LE:
+        return read_s16_le;
+    default:
+        return NULL;
+    }
+}
+
+/* Slot layout of the hardware frame: ALSA channel of a slot, or a value >= channels for silence */
+static unsigned int slot_channel(unsigned int slot)
+{
+    return num_channel_map ? channel_map[slot] : slot;
+}
+
+/* Check whether a stream with this channel count can use the pair packers directly */
+static bool slot_layout_is_identity(unsigned int channels)
+{
+    unsigned int slot;
+
+    if (channels != tdm_slots)
+        return false;
+
+    for (slot = 0; slot < tdm_slots; slot++)
+        if (slot_channel(slot) != slot)
+            return false;
+
+    return true;
+}
+
+/* Generic packer for remapped layouts: every slot is read through channel_map */
+static void pack_frames_remapped(struct dma_stream *s, uint64_t *dst, const uint8_t *src,
+                                 snd_pcm_uframes_t frames, unsigned int channels, unsigned int sample_bytes)
+{
+    unsigned int frame_bytes = channels * sample_bytes;
+    snd_pcm_uframes_t i;
+    unsigned int slot;
+
+    for (i = 0; i < frames; i++, src += frame_bytes) {
+        for (slot = 0; slot < tdm_slots; slot += 2) {
+            unsigned int left = slot_channel(slot);
+            unsigned int right = slot_channel(slot + 1);
+            uint64_t lr = 0;
+
+            if (left < channels)
+                lr |= s->read_sample(src + left * sample_bytes);
+            if (right < channels)
+                lr |= (uint64_t)s->read_sample(src + right * sample_bytes) << 24;
+
+            *dst++ = swab64(lr);
+        }
+    }
+}
+
+/* Scale a 24-bit sample by a gain with DMA_GAIN_SHIFT fractional bits, the gain never exceeds unity */
+static uint32_t dma_apply_gain(uint32_t sample, u32 gain)
+{
+    return ((s64)sign_extend32(sample, 23) * gain >> DMA_GAIN_SHIFT) & 0xffffff;
+}
+
+/* Generic packer with software volume: every sample is read, scaled by the gain of its channel and placed by channel_map */
+static void pack_frames_gain(struct dma_stream *s, uint64_t *dst, const uint8_t *src,
+                             snd_pcm_uframes_t frames, unsigned int channels, unsigned int sample_bytes)
+{
+    unsigned int frame_bytes = channels * sample_bytes;
+    u32 gain[DMA_MAX_TDM_SLOTS];
+    snd_pcm_uframes_t i;
+    unsigned int slot;
+
+    // One snapshot per run, a mixer change in between applies from the next run
+    for (slot = 0; slot < channels; slot++)
+        gain[slot] = READ_ONCE(s->chip->gain[slot]);
+
+    for (i = 0; i < frames; i++, src += frame_bytes) {
+        for (slot = 0; slot < tdm_slots; slot += 2) {
+            unsigned int left = slot_channel(slot);
+            unsigned int right = slot_channel(slot + 1);
+            uint64_t lr = 0;
+
+            if (left < channels)
+                lr |= dma_apply_gain(s->read_sample(src + left * sample_bytes), gain[left]);
+            if (right < channels)
+                lr |= (uint64_t)dma_apply_gain(s->read_sample(src + right * sample_bytes), gain[right]) << 24;
+
+            *dst++ = swab64(lr);
+        }
+    }
+}
+
+/* Select the packer for a sample format, NULL if the format is not packed by the CPU */
+static dma_pack_fn select_packer(snd_pcm_format_t format)
+{
+    switch (format) {
+    case SNDRV_PCM_FORMAT_S24_3LE:
+#ifdef DMA_HAVE_NEON_PACKERS
+        if (use_neon)
+            return pack_s24_3le_neon;
+#endif
+        return pack_s24_3le;
+    case SNDRV_PCM_FORMAT_S24_LE:
+#ifdef DMA_HAVE_NEON_PACKERS
+        if (use_neon)
+            return pack_s24_le_neon;
+#endif
+        return pack_s24_le;
+    case SNDRV_PCM_FORMAT_S32_LE:
+#ifdef DMA_HAVE_NEON_PACKERS
+        if (use_neon)
+            return pack_s32_le_neon;
+#endif
+        return pack_s32_le;
+    case SNDRV_PCM_FORMAT_S16_LE:
+#ifdef DMA_HAVE_NEON_PACKERS
+        if (use_neon)
+            return pack_s16_le_neon;
+#endif
+        return pack_s16_le;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Frame unpackers for capture
+ *
+ * The inverse of the packers: every 64-bit word captured by the DMA is split into its
+ * 2 24-bit slots, one byteswap puts both samples in little-endian order again.
+ * The 16 padding bits of the word are dropped.
+ */
+
+/* S24_3LE: one 32-bit and one 16-bit store per frame */
+static void unpack_s24_3le(uint8_t *dst, const uint64_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, dst += 6) {
+        uint64_t lr = swab64(src[i]);
+
+        put_unaligned_le32((uint32_t)lr, dst);
+        put_unaligned_le16((uint16_t)(lr >> 32), dst + 4);
+    }
+}
+
+/* S24_LE: the 24-bit sample is sign extended into its 4-byte container */
+static void unpack_s24_le(uint8_t *dst, const uint64_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, dst += 8) {
+        uint64_t lr = swab64(src[i]);
+
+        put_unaligned_le32((uint32_t)((int32_t)((uint32_t)lr << 8) >> 8), dst);
+        put_unaligned_le32((uint32_t)((int32_t)((uint32_t)(lr >> 24) << 8) >> 8), dst + 4);
+    }
+}
+
+/* S32_LE: the 24-bit sample fills the most significant bits, the low byte is zero */
+static void unpack_s32_le(uint8_t *dst, const uint64_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, dst += 8) {
+        uint64_t lr = swab64(src[i]);
+
+        put_unaligned_le32((uint32_t)lr << 8, dst);
+        put_unaligned_le32((uint32_t)(lr >> 24) << 8, dst + 4);
+    }
+}
+
+/* S16_LE: the sample is truncated to the 16 most significant bits of the slot */
+static void unpack_s16_le(uint8_t *dst, const uint64_t *src, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t i;
+
+    for (i = 0; i < frames; i++, dst += 4) {
+        uint64_t lr = swab64(src[i]);
+
+        put_unaligned_le16((uint16_t)(lr >> 8), dst);
+        put_unaligned_le16((uint16_t)(lr >> 32), dst + 2);
+    }
+}
+
+/* Sample writers for the remapped slot layout, the inverse of the sample readers */
+static void write_s24_3le(uint8_t *dst, uint32_t sample)
+{
+    put_unaligned_le16((uint16_t)sample, dst);
+    dst[2] = sample >> 16;
+}
+
+static void write_s24_le(uint8_t *dst, uint32_t sample)
+{
+    put_unaligned_le32((uint32_t)((int32_t)(sample << 8) >> 8), dst);
+}
+
+static void write_s32_le(uint8_t *dst, uint32_t sample)
+{
+    put_unaligned_le32(sample << 8, dst);
+}
+
+static void write_s16_le(uint8_t *dst, uint32_t sample)
+{
+    put_unaligned_le16((uint16_t)(sample >> 8), dst);
+}
+
+/* Select the unpacker for a sample format, NULL if the format is not unpacked by the CPU */
+static dma_unpack_fn select_unpacker(snd_pcm_format_t format)
+{
+    switch (format) {
+    case SNDRV_PCM_FORMAT_S24_3LE:
+        return unpack_s24_3le;
+    case SNDRV_PCM_FORMAT_S24_LE:
+        return unpack_s24_le;
+    case SNDRV_PCM_FORMAT_S32_LE:
+        return unpack_s32_le;
+    case SNDRV_PCM_FORMAT_S16_LE:
+        return unpack_s16_le;
+    default:
+        return NULL;
+    }
+}
+
+/* Select the sample writer for a sample format, NULL if the format is not unpacked by the CPU */
+static dma_sample_write_fn select_sample_writer(snd_pcm_format_t format)
+{
+    switch (format) {
+    case SNDRV_PCM_FORMAT_S24_3LE:
+        return write_s24_3le;
+    case SNDRV_PCM_FORMAT_S24_LE:
+        return write_s24_le;
+    case SNDRV_PCM_FORMAT_S32_LE:
+        return write_s32_le;
+    case SNDRV_PCM_FORMAT_S16_LE:
+        return write_s16_le;
+    default:
+        return NULL;
+    }
+}
+
+/* Generic unpacker for remapped layouts: every slot is written to its channel from channel_map */
+static void unpack_frames_remapped(struct dma_stream *s, uint8_t *dst, const uint64_t *src,
+                                   snd_pcm_uframes_t frames, unsigned int channels, unsigned int sample_bytes)
+{
+    unsigned int frame_bytes = channels * sample_bytes;
+    snd_pcm_uframes_t i;
+    unsigned int slot;
+
+    for (i = 0; i < frames; i++, dst += frame_bytes) {
+        // Channels without a slot record silence
+        memset(dst, 0, frame_bytes);
+
+        for (slot = 0; slot < tdm_slots; slot += 2) {
+            unsigned int left = slot_channel(slot);
+            unsigned int right = slot_channel(slot + 1);
+            uint64_t lr = swab64(*src++);
+
+            if (left < channels)
+                s->write_sample(dst + left * sample_bytes, lr & 0xffffff);
+            if (right < channels)
+                s->write_sample(dst + right * sample_bytes, (lr >> 24) & 0xffffff);
+        }
+    }
+}
+
+/* Pack one period from the ALSA buffer into a slot of the DMA buffer */
+static size_t pack_chunk(struct dma_stream *s, struct snd_pcm_runtime *runtime, const void *src, void *dst,
+                         snd_pcm_uframes_t frames)
+{
+    /*
+    This function is executed by dma_pack_ahead() for every run of frames that is added to the ring
+        The received data from the ALSA buffer is zero padded and combined to 2 samples per word in memory (64 bit or 8 bytes)
+        A frame takes tdm_slots / 2 words, all channels of a period end up in 1 DMA transfer
+        The software volume is applied in the same pass, at 0 dB on every channel the format packers run as is
+        The number of packed bytes is returned, 0 on an unsupported format
+    */
+
+    if (!s->pack_frames || !s->read_sample) {
+        pr_err("dma-alsa: unsupported runtime format in pack_chunk\n");
+        return 0;
+    }
+
+    if (!READ_ONCE(s->chip->gain_unity))
+        pack_frames_gain(s, dst, src, frames, runtime->channels,
+                         snd_pcm_format_physical_width(runtime->format) / 8);
+    else if (s->pack_remapped)
+        pack_frames_remapped(s, dst, src, frames, runtime->channels,
+                             snd_pcm_format_physical_width(runtime->format) / 8);
+    else
+        s->pack_frames(dst, src, frames * (tdm_slots / 2));
+
+    return frames * dma_frame_bytes;
+}
+
+/* Unpack one captured period from a slot of the DMA buffer into the ALSA buffer */
+static void unpack_period(struct dma_stream *s, struct snd_pcm_runtime *runtime, const void *src, void *dst)
+{
+    if (!s->unpack_frames || !s->write_sample) {
+        pr_err("dma-alsa: unsupported runtime format in unpack_period\n");
+        return;
+    }
+
+    if (s->pack_remapped)
+        unpack_frames_remapped(s, dst, src, runtime->period_size, runtime->channels,
+                               snd_pcm_format_physical_width(runtime->format) / 8);
+    else
+        s->unpack_frames(dst, src, runtime->period_size * (tdm_slots / 2));
+}
+
+/* Hand len bytes of a cached ring from offset on to the DMA, or back to the CPU */
+static void dma_sync_staging(struct dma_stream *s, size_t offset, size_t len, bool for_device)
+{
+    /*
+    This function is executed around every slot transfer of a cached ring
+        Playback cleans the slot to memory before the DMA reads it
+        Capture invalidates the slot before the DMA writes it and again before it is unpacked or read
+        The native format rings in the cached ALSA buffer itself, only the periods moved are synced
+        The DMA buffer is cached with noncoherent=1 or sg=1, a coherent one needs no sync
+        A noncontiguous buffer is synced page run by page run over the slot only
+    */
+
+    enum dma_data_direction dir = s->direction == SNDRV_PCM_STREAM_PLAYBACK ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    struct snd_dma_buffer *buf = s->ring_buf;
+    unsigned int chunk;
+    dma_addr_t addr;
+
+    if (buf == &s->dma_buffer && !noncoherent && !sg)
+        return;
+
+    // Both buffers are noncontiguous in sg mode, every contiguous run of the slot is synced on its own
+    while (len) {
+        addr = snd_sgbuf_get_addr(buf, offset);
+        chunk = snd_sgbuf_get_chunk_size(buf, offset, len);
+        if (for_device)
+            dma_sync_single_for_device(buf->dev.dev, addr, chunk, dir);
+        else
+            dma_sync_single_for_cpu(buf->dev.dev, addr, chunk, dir);
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+/* Pack the frames committed by the application into the free slots of the staging ring */
+// Called under the stream lock, from the ack callback or write_to_buffer()
+static void dma_pack_ahead(struct dma_stream *s, struct snd_pcm_runtime *runtime)
+{
+    /*
+    This function converts playback frames as soon as the application commits them
+        Packing continues from where the last call stopped, ring_packed frames behind the queued slots
+        Runs of frames never cross a period, the ALSA buffer holds whole periods and the slots are periods
+        At most every free slot of the ring is packed ahead, the rest waits for the DMA to complete slots
+        The stream lock is the only writer side of ring_packed here, so the packing runs without ring_lock,
+        with interrupts enabled for a nonatomic PCM, which the NEON packers need
+    */
+
+    snd_pcm_uframes_t period = runtime->period_size;
+    snd_pcm_uframes_t room = s->ring_slots * period;
+    snd_pcm_uframes_t offset = s->ring_queued * period + s->ring_packed;
+    snd_pcm_sframes_t ready = dma_frames_ready(s);
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t pos;
+    unsigned int slot;
+    size_t packed;
+    u64 pack_start;
+
+    while (offset < room && (snd_pcm_sframes_t)offset < ready) {
+        slot = (s->ring_head + s->ring_packed / period) % s->ring_slots;
+        pos = (s->driver_hw_ptr + offset) % runtime->buffer_size;
+        frames = min_t(snd_pcm_uframes_t, period - s->ring_packed % period, ready - offset);
+
+        pack_start = ktime_get_ns();
+        packed = pack_chunk(s, runtime, runtime->dma_area + frames_to_bytes(runtime, pos),
+                            s->ring_area + slot * s->ring_period_bytes + s->ring_packed % period * dma_frame_bytes,
+                            frames);
+        if (!packed)
+            break;
+        dma_stats_pack(s, ktime_get_ns() - pack_start, frames, period);
+
+        s->ring_packed += frames;
+        offset += frames;
+    }
+}
+
+/* Queue the next ring slot padded with silence, called from write_to_buffer() when the ring ran empty */
+static int dma_queue_silence(struct dma_stream *s, struct snd_pcm_runtime *runtime)
+{
+    /*
+    This function is executed by write_to_buffer() in free-running mode instead of stopping the stream
+        The frames the application already committed for the next period are kept, the rest of it becomes packed silence
+        The slot is claimed before it is padded, so the ack callback packs the next data behind it
+        The period is queued like any other one, the hardware pointer keeps running
+        A cyclic engine is already reading the slot at ring_head, that one plays as it is and the slot after it is padded
+        ALSA stops the stream itself when the application falls behind by stop_threshold
+    */
+
+    snd_pcm_uframes_t period = runtime->period_size;
+    bool in_place = dma_ring_in_place(s, runtime);
+    unsigned int slot;
+    snd_pcm_sframes_t have;
+    unsigned long flags;
+
+    // The frames packed into the slot the cyclic engine is in are played from there, partly stale,
+    // at trigger start the engine is not issued yet and the slot at ring_head is still free
+    if (cyclic && runtime->status->state == SNDRV_PCM_STATE_RUNNING) {
+        spin_lock_irqsave(&s->ring_lock, flags);
+        write_seqcount_begin(&s->ring_seq);
+        s->ring_head = (s->ring_head + 1) % s->ring_slots;
+        s->ring_queued++;
+        if (!in_place)
+            s->ring_packed -= min_t(snd_pcm_uframes_t, s->ring_packed, period);
+        write_seqcount_end(&s->ring_seq);
+        spin_unlock_irqrestore(&s->ring_lock, flags);
+    }
+    slot = s->ring_head;
+
+    spin_lock_irqsave(&s->ring_lock, flags);
+    if (in_place) {
+        have = clamp_t(snd_pcm_sframes_t, dma_frames_ready(s) - (snd_pcm_sframes_t)(s->ring_queued * period), 0, period);
+    } else {
+        have = s->ring_packed;
+        s->ring_packed = period;
+    }
+    spin_unlock_irqrestore(&s->ring_lock, flags);
+
+    memset(s->ring_area + slot * s->ring_period_bytes + have * dma_frame_bytes, 0, (period - have) * dma_frame_bytes);
+    dma_sync_staging(s, slot * s->ring_period_bytes, s->ring_period_bytes, true);
+
+    dma_stats_xrun(s, DMA_XRUN_SILENCE, have);
+    dma_stats_submit(s, slot);
+    if (!cyclic && start_dma_transfer(s, s->ring_period_bytes, slot * s->ring_period_bytes, slot, true)) {
+        pr_err("dma-alsa: failed to start DMA for silence in write_to_buffer\n");
+        dma_stats_xrun(s, DMA_XRUN_SUBMIT, have);
+        return -EIO;
+    }
+    trace_dma_alsa_submit(s->direction, slot, s->driver_hw_ptr, s->ring_period_bytes);
+
+    spin_lock_irqsave(&s->ring_lock, flags);
+    write_seqcount_begin(&s->ring_seq);
+    s->ring_head = (s->ring_head + 1) % s->ring_slots;
+    s->ring_queued++;
+    if (!in_place)
+        s->ring_packed -= period;
+    write_seqcount_end(&s->ring_seq);
+    spin_unlock_irqrestore(&s->ring_lock, flags);
+    return 0;
+}
+
+/* Write audio from ALSA buffer to dma_buffer */
+// Called from the work handler or from trigger start (atomic context with refill_mode=4), it must not sleep
+static int write_to_buffer(struct dma_stream *s)
+{
+    /*
+    This function is executed in the work handler to queue the new data of the DMA buffer
+        The ack callback already packed the committed frames into the free slots of the staging ring,
+        frames it has not seen yet are packed here
+        Every completely packed slot is queued, as long as the ring has room
+        The native format is already packed, its slots are the periods of the ALSA buffer and are queued as is
+        In one-shot/pipelined mode the slot is then queued to the DMA
+        In cyclic mode the running cyclic transfer picks up the slot by itself
+        An underrun or a failed submission is returned, the caller decides how the stream stops
+    */
+
+    if (READ_ONCE(s->dma_state) != DMA_ALSA_STATE_RUNNING)
+        return 0;
+    if(s->substream == NULL) {
+        pr_err("dma-alsa: substream NULL in write");
+        return -EINVAL;
+    }
+    struct snd_pcm_runtime *runtime = s->substream->runtime;
+    snd_pcm_sframes_t available_frames;
+    snd_pcm_uframes_t pack_ptr;
+    snd_pcm_sframes_t full;
+    unsigned long flags;
+    bool native;
+    bool last;
+
+    if(runtime == NULL) {
+        pr_err("dma-alsa: runtime NULL in write");
+        return -EINVAL;
+    }
+
+    if(s->dma_buffer.area == NULL) {
+        pr_err("dma-alsa: dma buffer NULL in write");
+        return -EINVAL;
+    }
+
+    available_frames = dma_frames_ready(s);
+
+    if (!free_run && !s->ring_queued && available_frames < (snd_pcm_sframes_t)runtime->period_size) {
+        dma_stats_xrun(s, runtime->status->state == SNDRV_PCM_STATE_RUNNING ? DMA_XRUN_NO_DATA : DMA_XRUN_START,
+                       available_frames);
+        return -EPIPE;
+    }
+
+    // In the native format the DMA reads the cached ALSA buffer itself, every queued period is synced below
+    native = dma_ring_in_place(s, runtime);
+    if (!native)
+        dma_pack_ahead(s, runtime);
+
+    // Queue the ring ahead of the hardware with every complete period, the ack callback only adds to ring_packed
+    for (;;) {
+        full = native ? available_frames / (snd_pcm_sframes_t)runtime->period_size - (snd_pcm_sframes_t)s->ring_queued :
+                        (snd_pcm_sframes_t)(READ_ONCE(s->ring_packed) / runtime->period_size);
+        if (s->ring_queued >= s->ring_depth || full < 1)
+            break;
+
+        pack_ptr = (s->driver_hw_ptr + s->ring_queued * runtime->period_size) % runtime->buffer_size;
+        // The last period queued for now has to interrupt, otherwise its completion is never seen
+        last = s->ring_queued + 1 == s->ring_depth || full < 2;
+
+        dma_sync_staging(s, s->ring_head * s->ring_period_bytes, s->ring_period_bytes, true);
+
+        // Timestamp before the submission, the completion may arrive before it returns
+        dma_stats_submit(s, s->ring_head);
+        if (!cyclic && start_dma_transfer(s, s->ring_period_bytes,
+                                          s->ring_head * s->ring_period_bytes, s->ring_head, last)) {
+            pr_err("dma-alsa: failed to start DMA for period in write_to_buffer\n");
+            // If this fails, the stream has to stop
+            dma_stats_xrun(s, DMA_XRUN_SUBMIT, available_frames);
+            return -EIO;
+        }
+        trace_dma_alsa_submit(s->direction, s->ring_head, pack_ptr, s->ring_period_bytes);
+
+        // The packed frames move into the queued slot, so the pack position of the ack callback stays put
+        spin_lock_irqsave(&s->ring_lock, flags);
+        write_seqcount_begin(&s->ring_seq);
+        s->ring_head = (s->ring_head + 1) % s->ring_slots;
+        s->ring_queued++;
+        if (!native)
+            s->ring_packed -= runtime->period_size;
+        write_seqcount_end(&s->ring_seq);
+        spin_unlock_irqrestore(&s->ring_lock, flags);
+    }
+
+    // Free-running, the engine is kept busy with silence when the application is late
+    if (free_run && !s->ring_queued && READ_ONCE(s->dma_state) == DMA_ALSA_STATE_RUNNING)
+        return dma_queue_silence(s, runtime);
+
+    return 0;
+}
+
+/* Copy the captured periods from their ring slots into the ALSA buffer */
+static void unpack_captured(struct dma_stream *s, unsigned int completed)
+{
+    /*
+    This function is executed in the work handler, before driver_hw_ptr advances
+        The oldest completed slots are unpacked in ring order, period by period from driver_hw_ptr on
+        The native format is captured straight into the ALSA buffer and needs no copy, only a cache sync of the periods
+    */
+
+    struct snd_pcm_runtime *runtime = s->substream->runtime;
+    unsigned int tail = (s->ring_head + s->ring_slots - s->ring_queued) % s->ring_slots;
+    snd_pcm_uframes_t unpack_ptr;
+    u64 unpack_start;
+    unsigned int i;
+
+    // The DMA wrote the cached ALSA buffer itself, stale cache lines have to go before the application reads
+    if (dma_format_is_native(runtime->format)) {
+        for (i = 0; i < completed; i++)
+            dma_sync_staging(s, (tail + i) % s->ring_slots * s->ring_period_bytes, s->ring_period_bytes, false);
+        return;
+    }
+
+    for (i = 0; i < completed; i++) {
+        unpack_ptr = (s->driver_hw_ptr + i * runtime->period_size) % runtime->buffer_size;
+
+        unpack_start = ktime_get_ns();
+        dma_sync_staging(s, (tail + i) % s->ring_slots * s->ring_period_bytes, s->ring_period_bytes, false);
+        unpack_period(s, runtime, s->ring_area + (tail + i) % s->ring_slots * s->ring_period_bytes,
+                      runtime->dma_area + frames_to_bytes(runtime, unpack_ptr));
+        dma_stats_pack(s, ktime_get_ns() - unpack_start, runtime->period_size, runtime->period_size);
+    }
+}
+
+/* Queue the free slots of the staging ring to the DMA for capture */
+// Called from the work handler or trigger start, like write_to_buffer
+static int read_from_buffer(struct dma_stream *s)
+{
+    /*
+    This function is executed in the work handler after the captured periods are unpacked
+        Every free slot of the staging ring is queued to the DMA to receive 1 period
+        The capture does not depend on the application, the ALSA buffer detects an overrun itself
+        In cyclic mode the running cyclic transfer fills the slot again by itself
+        A failed submission is returned, the caller decides how the stream stops
+    */
+
+    struct snd_pcm_runtime *runtime;
+    unsigned long flags;
+
+    if (READ_ONCE(s->dma_state) != DMA_ALSA_STATE_RUNNING || !s->substream)
+        return 0;
+
+    runtime = s->substream->runtime;
+
+    // No dirty cache line of the ring may be written back over the captured data later,
+    // in the native format the slots are the periods of the ALSA buffer
+    while (s->ring_queued < s->ring_depth) {
+        dma_sync_staging(s, s->ring_head * s->ring_period_bytes, s->ring_period_bytes, true);
+        dma_stats_submit(s, s->ring_head);
+        if (!cyclic && start_dma_transfer(s, s->ring_period_bytes,
+                                          s->ring_head * s->ring_period_bytes, s->ring_head,
+                                          s->ring_queued + 1 == s->ring_depth)) {
+            pr_err("dma-alsa: failed to start DMA for period in read_from_buffer\n");
+            dma_stats_xrun(s, DMA_XRUN_SUBMIT, snd_pcm_capture_avail(runtime));
+            return -EIO;
+        }
+        trace_dma_alsa_submit(s->direction, s->ring_head,
+                              (s->driver_hw_ptr + s->ring_queued * runtime->period_size) % runtime->buffer_size,
+                              s->ring_period_bytes);
+
+        spin_lock_irqsave(&s->ring_lock, flags);
+        write_seqcount_begin(&s->ring_seq);
+        s->ring_head = (s->ring_head + 1) % s->ring_slots;
+        s->ring_queued++;
+        write_seqcount_end(&s->ring_seq);
+        spin_unlock_irqrestore(&s->ring_lock, flags);
+    }
+
+    return 0;
+}
+
+/* Periods are queued ahead of the hardware, so the refill latency is hidden by the queue instead of the period */
+static bool dma_periods_queued_ahead(void)
+{
+    return cyclic || pipeline_depth > 1;
+}
+
+/* Scale a period size given at DMA_REFERENCE_RATE to another rate, keeping the period time */
+static size_t dma_period_bytes_at_rate(size_t bytes, unsigned int rate)
+{
+    return mult_frac(bytes, rate, DMA_REFERENCE_RATE);
+}
+
+/* hw rule: with 1 period in flight the min period size follows the rate */
+static int dma_pcm_rule_period_bytes(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+    struct snd_interval *rate = hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+    struct snd_interval range;
+
+    snd_interval_any(&range);
+    range.min = dma_period_bytes_at_rate(DMA_PERIOD_BYTES_MIN, rate->min);
+
+    return snd_interval_refine(hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIOD_BYTES), &range);
+}
+
+/* hw rule: with periods queued ahead the min period size follows the rate and the queue depth */
+static int dma_pcm_rule_period_size(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+    /*
+    This rule is executed by ALSA whenever the rate or the number of periods is refined
+        At least DMA_QUEUED_FRAMES_MIN frames stay queued ahead of the hardware, spread over the queue depth,
+        the deepest queue the periods still allow gives the lower bound
+        A cyclic ring queues every period, one-shot mode pipeline_depth of them
+    */
+
+    struct snd_interval *rate = hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+    struct snd_interval *periods = hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIODS);
+    unsigned int depth = cyclic ? min_t(unsigned int, periods->max, DMA_MAX_PERIODS) : pipeline_depth;
+    struct snd_interval range;
+
+    snd_interval_any(&range);
+    range.min = dma_period_bytes_at_rate(max_t(unsigned int, DMA_PERIOD_FRAMES_MIN, DMA_QUEUED_FRAMES_MIN / depth),
+                                         rate->min);
+
+    return snd_interval_refine(hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE), &range);
+}
+
+/* Make sure the DMA buffer of a stream holds at least bytes */
+static int dma_reserve_staging(struct dma_stream *s, size_t bytes)
+{
+    /*
+    This function is executed at probe and in hw_params, never while the stream runs
+        A DMA buffer that is large enough already is reused as is
+        Otherwise it is replaced by one of the requested size, so it only grows to what the streams negotiate
+        The buffer is coherent and physically contiguous, cached and noncontiguous (module parameter sg),
+        or cached and physically contiguous (module parameter noncoherent)
+        It is allocated from the DMA device, which stays referenced while the channel is released
+    */
+
+    enum dma_data_direction dir = s->direction == SNDRV_PCM_STREAM_PLAYBACK ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    struct snd_dma_buffer buffer;
+
+    bytes = PAGE_ALIGN(bytes);
+    if (bytes <= s->dma_buffer.bytes)
+        return 0;
+
+    // In sg mode the buffer is collected from single pages behind the IOMMU, no contiguous memory
+    // is needed, a noncontiguous or noncoherent buffer is cached and synced per slot in the stream direction
+    if (snd_dma_alloc_dir_pages(sg ? SNDRV_DMA_TYPE_NONCONTIG : noncoherent ? SNDRV_DMA_TYPE_NONCOHERENT : SNDRV_DMA_TYPE_DEV,
+                                s->dma_dev, dir, bytes, &buffer)) {
+        pr_err("dma-alsa: could not allocate a %s dma buffer of %zu bytes\n", s->name, bytes);
+        return -ENOMEM;
+    }
+
+    if (s->dma_buffer.area)
+        snd_dma_free_pages(&s->dma_buffer);
+
+    s->dma_buffer = buffer;
+    pr_info("dma-alsa: %s dma buffer of %zu bytes allocated\n", s->name, bytes);
+    return 0;
+}
+
+/* Size of the staging ring for the negotiated parameters */
+static size_t dma_staging_bytes(struct snd_pcm_hw_params *params, bool direct)
+{
+    size_t period_bytes = params_period_size(params) * dma_frame_bytes;
+
+    // The native format uses the ALSA buffer itself
+    if (dma_format_is_native(params_format(params)))
+        return 0;
+
+    // The cyclic ring and the direct copy span the whole buffer, pipelined mode keeps pipeline_depth periods
+    if (cyclic || direct)
+        return min_t(size_t, params_periods(params) * period_bytes, AUDIO_BUFFER_SIZE);
+
+    return min_t(size_t, pipeline_depth * period_bytes, AUDIO_BUFFER_SIZE);
+}
+
+/* PCM open callback */
+static int dma_pcm_open(struct snd_pcm_substream *substream)
+{
+    /*
+    This callback is executed when an application opens the PCM device
+        The pcm hardware specific parameters of the device are set
+        The rate list and the period size constraints are added: the minimum follows the rate and
+        the queue depth, the maximum the DMA buffer and the max segment size of the channel
+        The device is resumed first, the constraints depend on the capabilities of the channel
+        The DMA buffer of the stream is reused, it lives from probe to remove
+        The hardware pointer is reset
+    */
+
+    struct dma_alsa_chip *chip = snd_pcm_substream_chip(substream);
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned int period_frames_max;
+    int err;
+
+    // The channels are released while the device is idle, the first open requests them again
+    err = pm_runtime_resume_and_get(chip->dev);
+    if (err < 0)
+        return err;
+
+    runtime->hw = chip->hw;
+
+    // With a residue based pointer the position is no longer updated per period only
+    // Captured periods are only readable once unpacked, so capture keeps the period granularity
+    if (s->residue_pointer && s->direction == SNDRV_PCM_STREAM_PLAYBACK)
+        runtime->hw.info &= ~SNDRV_PCM_INFO_BATCH;
+
+    // Playback frames are packed and queued as soon as they are committed, a rewind cannot take them back
+    if (s->direction == SNDRV_PCM_STREAM_PLAYBACK)
+        runtime->hw.info |= SNDRV_PCM_INFO_NO_REWINDS;
+
+    // Outer period window over all rates, the rate and depth specific minimum is applied by a rule,
+    // a packed period is a whole number of 64-bit words by construction
+    runtime->hw.period_bytes_min = dma_periods_queued_ahead() ? 1 :
+                                   dma_period_bytes_at_rate(DMA_PERIOD_BYTES_MIN, runtime->hw.rate_min);
+    runtime->hw.period_bytes_max = DMA_PERIOD_BYTES_MAX;
+
+    // The staging ring holds whole periods, so the ALSA buffer must not end in a partial period
+    err = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+    if (err < 0)
+        goto err_pm;
+
+    // At least 2 packed periods have to fit the DMA buffer, and a contiguous period 1 DMA segment
+    period_frames_max = AUDIO_BUFFER_SIZE / (2 * dma_frame_bytes);
+    if (!sg)
+        period_frames_max = min_t(unsigned int, period_frames_max, s->max_seg_bytes / dma_frame_bytes);
+    err = snd_pcm_hw_constraint_minmax(runtime, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, 1, period_frames_max);
+    if (err < 0)
+        goto err_pm;
+
+    err = snd_pcm_hw_constraint_list(runtime, 0, SNDRV_PCM_HW_PARAM_RATE, &chip->rate_constraint);
+    if (err < 0)
+        goto err_pm;
+
+    if (dma_periods_queued_ahead())
+        err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+                                  dma_pcm_rule_period_size, NULL,
+                                  SNDRV_PCM_HW_PARAM_RATE, SNDRV_PCM_HW_PARAM_PERIODS, -1);
+    else
+        err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_PERIOD_BYTES,
+                                  dma_pcm_rule_period_bytes, NULL,
+                                  SNDRV_PCM_HW_PARAM_RATE, -1);
+    if (err < 0)
+        goto err_pm;
+
+    // The direct copy keeps the whole buffer packed in the DMA buffer, mmap would bypass the copy callbacks
+    if (direct_copy && s->direction == SNDRV_PCM_STREAM_PLAYBACK) {
+        runtime->hw.info &= ~(SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID);
+
+        err = snd_pcm_hw_constraint_minmax(runtime, SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+                                           1, AUDIO_BUFFER_SIZE / dma_frame_bytes);
+        if (err < 0)
+            goto err_pm;
+    }
+
+    s->substream = substream;
+    s->driver_hw_ptr = 0;
+
+    pr_info("dma-alsa: %s PCM opened, DMA buffer of %zu bytes at %p\n", s->name, s->dma_buffer.bytes, s->dma_buffer.area);
+    return 0;
+
+err_pm:
+    pm_runtime_mark_last_busy(chip->dev);
+    pm_runtime_put_autosuspend(chip->dev);
+    return err;
+}
+
+/* PCM close callback */
+static int dma_pcm_close(struct snd_pcm_substream *substream)
+{
+    /*
+    This callback is executed when an application closes the PCM device
+        The DMA buffer is kept for the next open, ALSA releases the managed ALSA buffer
+        The substream pointer of the stream is dereferenced
+        The channels are released once the device stayed idle for autosuspend_ms
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+
+    // sync_stop already flushed the refill work, a late completion finds no substream
+    WRITE_ONCE(s->substream, NULL);
+
+    pm_runtime_mark_last_busy(s->chip->dev);
+    pm_runtime_put_autosuspend(s->chip->dev);
+    return 0;
+}
+
+/* PCM hw_params callback */
+static int dma_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *params)
+{
+    /*
+    This callback is executed when new parameters of the pcm device need to be set
+        The requested parameters are checked against what the module supports,
+        ALSA sets the period and buffer size refined by the constraints of open
+        ALSA already allocated the managed ALSA buffer from the DMA device
+        The DMA buffer grows to the staging ring of these parameters if it is too small
+        The packer (playback) or unpacker (capture) of the format is selected
+    */
+
+    struct dma_alsa_chip *chip = snd_pcm_substream_chip(substream);
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    snd_pcm_format_t format = params_format(params);
+    unsigned int i;
+    int err;
+
+    if (!runtime) {
+        pr_err("dma-alsa: runtime is NULL\n");
+        return -EINVAL;
+    }
+
+    if (!select_packer(format) && !dma_format_is_native(format)) {
+        pr_err("dma-alsa: unsupported format requested: %d\n", format);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < chip->rate_constraint.count; i++)
+        if (chip->rates[i] == params_rate(params))
+            break;
+    if (i == chip->rate_constraint.count) {
+        pr_err("dma-alsa: unsupported sample rate requested: %u\n", params_rate(params));
+        return -EINVAL;
+    }
+
+    if (params_channels(params) < 1 || params_channels(params) > tdm_slots) {
+        pr_err("dma-alsa: unsupported number of channels: %u\n", params_channels(params));
+        return -EINVAL;
+    }
+
+    // The native format already is the hardware frame, so it has to fill every slot
+    if (dma_format_is_native(format) && params_channels(params) != tdm_slots) {
+        pr_err("dma-alsa: native format needs %u channels\n", tdm_slots);
+        return -EINVAL;
+    }
+
+    // The period and buffer sizes are refined by the constraints of open, out of range is a bug
+    if (params_buffer_bytes(params) > AUDIO_BUFFER_SIZE || params_periods(params) > DMA_MAX_PERIODS) {
+        pr_err("dma-alsa: buffer of %u bytes in %u periods out of range\n",
+               params_buffer_bytes(params), params_periods(params));
+        return -EINVAL;
+    }
+
+    // The direct copy packs into the DMA buffer and leaves the ALSA buffer of the packed formats untouched
+    s->direct = direct_copy && s->direction == SNDRV_PCM_STREAM_PLAYBACK && !dma_format_is_native(format);
+
+    // The cyclic transfer restarts at slot 0, a ring laid out like the ALSA buffer resumes through prepare
+    if (cyclic && (s->direct || dma_format_is_native(format)))
+        params->info &= ~SNDRV_PCM_INFO_RESUME;
+
+    // ALSA ran sync_stop before, no refill work uses the DMA buffer any more
+    err = dma_reserve_staging(s, dma_staging_bytes(params, s->direct));
+    if (err)
+        return err;
+
+    runtime->frame_bits = params_channels(params) * snd_pcm_format_physical_width(format);
+    s->pack_frames = select_packer(format);
+    s->read_sample = select_sample_reader(format);
+    s->unpack_frames = select_unpacker(format);
+    s->write_sample = select_sample_writer(format);
+    s->pack_remapped = !slot_layout_is_identity(params_channels(params));
+
+    pr_info("dma-alsa: %s hw_params configured, buffer_size=%u frames, period_size=%u frames, address=%p\n",
+            s->name, params_buffer_size(params), params_period_size(params), runtime->dma_area);
+
+    return 0;
+}
+
+/* Frames the DMA already transferred beyond driver_hw_ptr, derived from the residue */
+static snd_pcm_uframes_t dma_played_frames(struct dma_stream *s, struct snd_pcm_runtime *runtime)
+{
+    /*
+    This function is executed by the pointer callback inside a ring_seq read section
+        In cyclic mode the residue of the cyclic descriptor gives the position in the whole ring
+        In one-shot/pipelined mode the queued descriptors are walked from the oldest one,
+        completed ones (callback not handled yet) count as a full period
+    */
+
+    struct dma_tx_state state;
+    enum dma_status status;
+    size_t ring_bytes = s->ring_slots * s->ring_period_bytes;
+    unsigned int tail = (s->ring_head + s->ring_slots - s->ring_queued) % s->ring_slots;
+    snd_pcm_uframes_t played = 0;
+    size_t pos;
+    unsigned int i;
+
+    if (cyclic) {
+        status = dmaengine_tx_status(s->dma_channel, s->cyclic_cookie, &state);
+        if (status == DMA_ERROR || state.residue > ring_bytes)
+            return 0;
+
+        // Distance from the start of the oldest queued slot to the current position
+        pos = (ring_bytes - state.residue + ring_bytes - tail * s->ring_period_bytes) % ring_bytes;
+        played = pos / dma_frame_bytes;
+    } else {
+        for (i = 0; i < s->ring_queued; i++) {
+            status = dmaengine_tx_status(s->dma_channel, s->ring_slot[(tail + i) % s->ring_slots].cookie, &state);
+            if (status == DMA_COMPLETE) {
+                played += runtime->period_size;
+                continue;
+            }
+            if (status != DMA_ERROR && state.residue <= s->ring_period_bytes)
+                played += (s->ring_period_bytes - state.residue) / dma_frame_bytes;
+            break;
+        }
+    }
+
+    // Never report more than what is queued, the rest is not valid data
+    return min_t(snd_pcm_uframes_t, played, s->ring_queued * runtime->period_size - 1);
+}
+
+/* PCM pointer callback */
+static snd_pcm_uframes_t dma_pcm_pointer(struct snd_pcm_substream *substream)
+{
+    /*
+    This callback is executed whenever the application wants to know where the hardware
+    is currently located in the ALSA ringbuffer = the hardware pointer
+    Packed capture data is only valid once unpacked, so there the residue is used for the native format only
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    snd_pcm_uframes_t hw_ptr;
+    unsigned int seq;
+    bool use_residue = s->residue_pointer &&
+                       (s->direction == SNDRV_PCM_STREAM_PLAYBACK || dma_format_is_native(runtime->format));
+
+    // Retried when the refill moved the ring meanwhile, the pointer never waits for a lock
+    do {
+        seq = read_seqcount_begin(&s->ring_seq);
+        hw_ptr = s->driver_hw_ptr;
+        if (use_residue && s->ring_queued)
+            hw_ptr = (hw_ptr + dma_played_frames(s, runtime)) % runtime->buffer_size;
+    } while (read_seqcount_retry(&s->ring_seq, seq));
+
+    trace_dma_alsa_pointer(s->direction, hw_ptr, s->driver_hw_ptr);
+
+    return hw_ptr;
+}
+
+/* PCM get_time_info callback */
+static int dma_pcm_get_time_info(struct snd_pcm_substream *substream, struct timespec64 *system_ts,
+                                 struct timespec64 *audio_ts,
+                                 struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+                                 struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+    /*
+    This callback is executed with the hardware pointer update when the application asked for link timestamps
+        With the DMA residue, the position is read from the engine together with the system time
+        Otherwise the position and the time of the last DMA completion are reported, free of the refill delay
+        The audio timestamp is the position since the start in ns at the stream rate
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    bool use_residue = s->residue_pointer &&
+                       (s->direction == SNDRV_PCM_STREAM_PLAYBACK || dma_format_is_native(runtime->format));
+    unsigned int seq;
+    ktime_t time;
+    u64 frames;
+    u32 rem;
+
+    if (audio_tstamp_config->type_requested != SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK) {
+        audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+        return 0;
+    }
+
+    do {
+        seq = read_seqcount_begin(&s->ring_seq);
+        if (use_residue) {
+            frames = s->hw_ptr_frames;
+            if (s->ring_queued)
+                frames += dma_played_frames(s, runtime);
+            time = ktime_get();
+        } else {
+            frames = s->done_periods * runtime->period_size;
+            time = s->done_time;
+        }
+    } while (read_seqcount_retry(&s->ring_seq, seq));
+
+    // The system timestamp is in the clock the application selected, moved back to the time of the position
+    snd_pcm_gettime(runtime, system_ts);
+    *system_ts = timespec64_sub(*system_ts, ns_to_timespec64(ktime_to_ns(ktime_sub(ktime_get(), time))));
+
+    audio_ts->tv_sec = div_u64_rem(frames, runtime->rate, &rem);
+    audio_ts->tv_nsec = div_u64((u64)rem * NSEC_PER_SEC, runtime->rate);
+
+    // The residue position is good to a frame, a completion is exact up to the interrupt latency
+    audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+    audio_tstamp_report->accuracy_report = use_residue;
+    audio_tstamp_report->accuracy = use_residue ? DIV_ROUND_UP(NSEC_PER_SEC, runtime->rate) : 0;
+    return 0;
+}
+
+/* Pack a run of application frames at byte position pos of the ALSA buffer into the ring */
+static void dma_copy_pack(struct dma_stream *s, struct snd_pcm_runtime *runtime, unsigned long pos,
+                          const void *src, unsigned long bytes)
+{
+    u64 pack_start = ktime_get_ns();
+
+    pack_chunk(s, runtime, src, s->ring_area + bytes_to_frames(runtime, pos) * dma_frame_bytes,
+               bytes_to_frames(runtime, bytes));
+    dma_stats_pack(s, ktime_get_ns() - pack_start, bytes_to_frames(runtime, bytes), runtime->period_size);
+}
+
+/* PCM copy_user callback of the direct copy */
+static int dma_pcm_copy_user(struct snd_pcm_substream *substream, int channel, unsigned long pos,
+                             void __user *buf, unsigned long bytes)
+{
+    /*
+    This callback is executed by ALSA for every write() of the application instead of copying into the ALSA buffer
+        The native format is copied into the ALSA buffer, which the DMA reads itself
+        Packed formats are staged in small L1-sized steps and packed straight into the DMA buffer,
+        the position in the ALSA buffer gives the position in the ring
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned long step = sizeof(s->copy_bounce) / frames_to_bytes(runtime, 1) * frames_to_bytes(runtime, 1);
+    unsigned long n;
+
+    if (!s->direct)
+        return copy_from_user(runtime->dma_area + pos, buf, bytes) ? -EFAULT : 0;
+
+    while (bytes) {
+        n = min(bytes, step);
+        if (copy_from_user(s->copy_bounce, buf, n))
+            return -EFAULT;
+
+        dma_copy_pack(s, runtime, pos, s->copy_bounce, n);
+        pos += n;
+        buf += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/* PCM copy_kernel callback of the direct copy, for in-kernel clients */
+static int dma_pcm_copy_kernel(struct snd_pcm_substream *substream, int channel, unsigned long pos,
+                               void *buf, unsigned long bytes)
+{
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    if (!s->direct)
+        memcpy(runtime->dma_area + pos, buf, bytes);
+    else
+        dma_copy_pack(s, runtime, pos, buf, bytes);
+
+    return 0;
+}
+
+/* PCM fill_silence callback of the direct copy */
+static int dma_pcm_fill_silence(struct snd_pcm_substream *substream, int channel, unsigned long pos,
+                                unsigned long bytes)
+{
+    /*
+    This callback is executed by ALSA to silence a part of the buffer, e.g. behind the last period of a drain
+        Packed zero words are silence for every format, they are written into the ring directly
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    if (!s->direct)
+        memset(runtime->dma_area + pos, 0, bytes);
+    else
+        memset(s->ring_area + bytes_to_frames(runtime, pos) * dma_frame_bytes, 0,
+               bytes_to_frames(runtime, bytes) * dma_frame_bytes);
+
+    return 0;
+}
+
+/* PCM ack callback */
+static int dma_pcm_ack(struct snd_pcm_substream *substream)
+{
+    /*
+    This callback is executed by ALSA with the stream lock held whenever the application pointer moves
+        Packed playback converts the newly committed frames into the staging ring right away,
+        so the refill work only submits periods that are packed already
+        Capture, the native format and the direct copy have nothing to convert ahead
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    if (s->direction != SNDRV_PCM_STREAM_PLAYBACK || dma_ring_in_place(s, runtime) || !s->ring_slots)
+        return 0;
+
+    dma_pack_ahead(s, runtime);
+    return 0;
+}
+
+/* PCM hw_free callback */
+static int dma_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+    /*
+    This callback is executed by ALSA to free all hardware and buffers
+        ALSA frees the managed ALSA buffer after this callback
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+
+    if (!runtime || !s->dma_buffer.area) {
+        pr_err("dma-alsa: hw free failed, invalid runtime or buffer\n");
+        return -EINVAL;
+    }
+
+    pr_info("dma-alsa: hw free successful\n");
+    return 0;
+}
+
+/* PCM prepare callback */
+static int dma_pcm_prepare(struct snd_pcm_substream *substream)
+{
+    /*
+    The prepare callback is called by ALSA when a sound stream (playback or capture) is ready to start
+    This occurs just before the trigger callback with the SNDRV_PCM_TRIGGER_START command is called
+        The runtime and DMA buffer need to be checked for existance
+        Earlier DMA transfers need to be stopped
+        The staging ring is sized for the negotiated period and the pointers are reset
+        In cyclic mode the descriptor is prearmed, so trigger start only issues it
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned long flags;
+
+    if (!runtime || !s->dma_buffer.area) {
+        pr_err("dma-alsa: prepare failed, invalid runtime or buffer\n");
+        return -EINVAL;
+    }
+
+    if (runtime->buffer_size == 0 || runtime->period_size == 0) {
+        pr_err("dma-alsa: Invalid buffer_size or period_size in prepare\n");
+        return -EINVAL;
+    }
+
+    pr_info("dma-alsa: preparing %s hw, resetting DMA and buffers\n", s->name);
+    dmaengine_terminate_sync(s->dma_channel);
+
+    s->ring_period_bytes = runtime->period_size * dma_frame_bytes;
+
+    if (dma_format_is_native(runtime->format)) {
+        // Zero-copy: the slots are the periods of the ALSA buffer itself
+        s->ring_area = runtime->dma_area;
+        s->ring_buf = runtime->dma_buffer_p;
+        s->ring_slots = runtime->periods;
+        s->ring_depth = cyclic ? s->ring_slots : min(pipeline_depth, s->ring_slots);
+    } else if (s->direct) {
+        // The copy callbacks pack every period into the slot of the same index, so the ring spans the buffer
+        if (runtime->periods * s->ring_period_bytes > s->dma_buffer.bytes) {
+            pr_err("dma-alsa: packed buffer of %zu bytes does not fit the DMA buffer\n",
+                   runtime->periods * s->ring_period_bytes);
+            return -EINVAL;
+        }
+
+        s->ring_area = s->dma_buffer.area;
+        s->ring_buf = &s->dma_buffer;
+        s->ring_slots = runtime->periods;
+        s->ring_depth = cyclic ? s->ring_slots : min(pipeline_depth, s->ring_slots);
+    } else {
+        if (s->ring_period_bytes > s->dma_buffer.bytes) {
+            pr_err("dma-alsa: packed period of %zu bytes does not fit the DMA buffer\n", s->ring_period_bytes);
+            return -EINVAL;
+        }
+
+        // Pipelined mode keeps pipeline_depth periods in flight, cyclic mode uses as many slots as fit
+        s->ring_area = s->dma_buffer.area;
+        s->ring_buf = &s->dma_buffer;
+        s->ring_slots = cyclic ? runtime->periods : pipeline_depth;
+        s->ring_slots = min_t(unsigned int, s->ring_slots, s->dma_buffer.bytes / s->ring_period_bytes);
+        s->ring_depth = s->ring_slots;
+    }
+
+    // Coalesced interrupts must leave a period in flight when they arrive, or the engine drains in between
+    s->irq_interval = clamp_t(unsigned int, irq_interval, 1, max(s->ring_depth, 2U) - 1);
+    s->irq_pending = 0;
+
+    // Slots that are not packed yet play silence instead of stale data
+    if (cyclic && s->direction == SNDRV_PCM_STREAM_PLAYBACK) {
+        memset(s->ring_area, 0, s->ring_slots * s->ring_period_bytes);
+        dma_sync_staging(s, 0, s->ring_slots * s->ring_period_bytes, true);
+    }
+
+    spin_lock_irqsave(&s->ring_lock, flags);
+    write_seqcount_begin(&s->ring_seq);
+    s->ring_head = 0;
+    s->ring_queued = 0;
+    s->ring_packed = 0;
+    s->driver_hw_ptr = 0;
+    s->hw_ptr_frames = 0;
+    s->done_periods = 0;
+    write_seqcount_end(&s->ring_seq);
+    spin_unlock_irqrestore(&s->ring_lock, flags);
+    s->cyclic_done_slot = 0;
+    atomic_set(&s->periods_completed, 0);
+    dma_stats_prepare(s);
+
+    // The descriptor setup of the cyclic transfer is done here, off the start path
+    s->cyclic_armed = false;
+    if (cyclic && arm_dma_cyclic(s, s->ring_buf->addr, s->ring_slots * s->ring_period_bytes, s->ring_period_bytes))
+        return -EIO;
+
+    pr_info("dma-alsa: prepare completed successfully\n");
+    return 0;
+}
+
+/* PCM trigger callback */
+static int dma_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+    /*
+    This callback is executed when a certain trigger is sent to the pcm stream: start, stop, pause, suspend
+        The received trigger is determined (start / stop)
+        Action is taken accordingly to the trigger type
+        Resume after a system suspend rewinds the ring to driver_hw_ptr and starts like start
+    */
+
+    struct dma_stream *s = dma_stream_of(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned long flags;
+    int err;
+
+    pr_debug("dma-alsa: Current ALSA state: %d\n", runtime->status->state);
+
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_RESUME:
+        pr_debug("dma-alsa: %s resumed from suspend\n", s->name);
+        if (!s->dma_channel)
+            return -ENODEV;
+        // The transfers in flight at suspend were terminated, their periods are queued again
+        // from driver_hw_ptr on, the cyclic transfer starts over at slot 0
+        spin_lock_irqsave(&s->ring_lock, flags);
+        write_seqcount_begin(&s->ring_seq);
+        s->ring_head = cyclic ? 0 : (s->ring_head + s->ring_slots - s->ring_queued) % s->ring_slots;
+        s->ring_queued = 0;
+        s->ring_packed = 0;
+        write_seqcount_end(&s->ring_seq);
+        spin_unlock_irqrestore(&s->ring_lock, flags);
+        s->cyclic_done_slot = 0;
+        s->irq_pending = 0;
+        atomic_set(&s->periods_completed, 0);
+        if (cyclic && s->direction == SNDRV_PCM_STREAM_PLAYBACK) {
+            memset(s->ring_area, 0, s->ring_slots * s->ring_period_bytes);
+            dma_sync_staging(s, 0, s->ring_slots * s->ring_period_bytes, true);
+        }
+        fallthrough;
+
+    case SNDRV_PCM_TRIGGER_START:
+        pr_debug("dma-alsa: %s started\n", s->name);
+        // Position 0 of the audio timestamps is the start of the DMA
+        spin_lock_irqsave(&s->ring_lock, flags);
+        write_seqcount_begin(&s->ring_seq);
+        s->done_time = ktime_get();
+        write_seqcount_end(&s->ring_seq);
+        spin_unlock_irqrestore(&s->ring_lock, flags);
+        // Queue every period the application already wrote (packed by the ack callback) in one chain,
+        // capture queues empty slots
+        // A start without data or a failed submission fails the trigger, ALSA stops the stream again
+        WRITE_ONCE(s->dma_state, DMA_ALSA_STATE_RUNNING);
+        if (s->direction == SNDRV_PCM_STREAM_CAPTURE)
+            err = read_from_buffer(s);
+        else
+            err = write_to_buffer(s);
+        if (err) {
+            WRITE_ONCE(s->dma_state, DMA_ALSA_STATE_STOPPED);
+            return err;
+        }
+        if (cyclic && s->ring_queued) {
+            if (!s->cyclic_armed &&
+                arm_dma_cyclic(s, s->ring_buf->addr, s->ring_slots * s->ring_period_bytes, s->ring_period_bytes)) {
+                WRITE_ONCE(s->dma_state, DMA_ALSA_STATE_STOPPED);
+                return -EIO;
+            }
+            dma_async_issue_pending(s->dma_channel);
+            s->cyclic_armed = false;
+        }
+        break;
+
+    case SNDRV_PCM_TRIGGER_STOP:
+    case SNDRV_PCM_TRIGGER_SUSPEND:
+        pr_debug("dma-alsa: %s stopped\n", s->name);
+        // Trigger may be atomic, sync_stop waits for the callbacks before the stream is touched again
+        dmaengine_terminate_async(s->dma_channel);
+        WRITE_ONCE(s->dma_state, DMA_ALSA_STATE_STOPPED);
+        atomic_set(&s->periods_completed, 0);
+        s->cyclic_armed = false;
+        break;
+
+    case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+        pr_debug("dma-alsa: %s paused\n", s->name);
+        dmaengine_pause(s->dma_channel);
+        break;
+
+    case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+        pr_debug("dma-alsa: %s resumed\n", s->name);
+        dmaengine_resume(s->dma_channel);
+        WRITE_ONCE(s->dma_state, DMA_ALSA_STATE_RUNNING);
+        break;
+
+    default:
+        pr_err("dma-alsa: unsupported trigger command: %d\n", cmd);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Wait for the callbacks of the terminated descriptors of a stream and the refill work they queued */
+static void dma_stream_sync(struct dma_stream *s)
+{
+    dmaengine_synchronize(s->dma_channel);
+
+    if (s->chip->dma_kworker)
+        kthread_flush_work(&s->dma_kwork);
+    flush_work(&s->dma_work);
+}
+
+/* PCM sync_stop callback */
+static int dma_pcm_sync_stop(struct snd_pcm_substream *substream)
+{
+    /*
+    This callback is executed by ALSA in non-atomic context after a stop, before prepare, hw_params, hw_free and close
+        The callbacks of the terminated descriptors are waited for
+        The refill work they queued is flushed, so it never runs on a stream that is set up again
+    */
+
+    dma_stream_sync(dma_stream_of(substream));
+    return 0;
+}
+
+/* PCM operations */
+static struct snd_pcm_ops dma_pcm_ops = {
+    /*
+    This struct contains the callback functions for pcm stream operations from ALSA
+    */
+
+    .open = dma_pcm_open,
+    .close = dma_pcm_close,
+    .ioctl = snd_pcm_lib_ioctl,
+    .hw_params = dma_pcm_hw_params,
+    .hw_free = dma_pcm_hw_free,
+    .prepare = dma_pcm_prepare,
+    .trigger = dma_pcm_trigger,
+    .sync_stop = dma_pcm_sync_stop,
+    .pointer = dma_pcm_pointer,
+    .get_time_info = dma_pcm_get_time_info,
+    .ack = dma_pcm_ack,
+};
+
+/* PCM operations of playback with direct_copy */
+static struct snd_pcm_ops dma_pcm_direct_ops = {
+    /*
+    This struct contains the callback functions for pcm stream operations from ALSA
+    ALSA hands the application data to the copy callbacks instead of writing an ALSA buffer
+    */
+
+    .open = dma_pcm_open,
+    .close = dma_pcm_close,
+    .ioctl = snd_pcm_lib_ioctl,
+    .hw_params = dma_pcm_hw_params,
+    .hw_free = dma_pcm_hw_free,
+    .prepare = dma_pcm_prepare,
+    .trigger = dma_pcm_trigger,
+    .sync_stop = dma_pcm_sync_stop,
+    .pointer = dma_pcm_pointer,
+    .get_time_info = dma_pcm_get_time_info,
+    .ack = dma_pcm_ack,
+    .copy_user = dma_pcm_copy_user,
+    .copy_kernel = dma_pcm_copy_kernel,
+    .fill_silence = dma_pcm_fill_silence,
+};
+
+/* Set up the supported rates of a device from the device tree or the rates parameter */
+static int init_rates(struct dma_alsa_chip *chip)
+{
+    /*
+    This function is part of the probe of a device to set up its rates
+        The rates property of the device tree node overrides the rates parameter
+        Every rate is checked against the range ALSA and the period window support
+        The rate bits and limits of the hardware description of the device are derived from the list
+    */
+
+    struct snd_pcm_hardware *hw = &chip->hw;
+    int count;
+    int i;
+
+    *hw = dma_pcm_hardware;
+
+    count = device_property_count_u32(chip->dev, "rates");
+    if (count > 0) {
+        if (count > DMA_MAX_RATES) {
+            pr_err("dma-alsa: %s: more than %d rates in the device tree\n", dev_name(chip->dev), DMA_MAX_RATES);
+            return -EINVAL;
+        }
+        device_property_read_u32_array(chip->dev, "rates", chip->rates, count);
+    } else {
+        count = num_rates;
+        memcpy(chip->rates, rates, sizeof(chip->rates));
+    }
+
+    if (count < 1) {
+        pr_err("dma-alsa: no sample rates configured\n");
+        return -EINVAL;
+    }
+
+    hw->rates = 0;
+    hw->rate_min = UINT_MAX;
+    hw->rate_max = 0;
+
+    for (i = 0; i < count; i++) {
+        if (chip->rates[i] < 8000 || chip->rates[i] > 192000) {
+            pr_err("dma-alsa: unsupported sample rate: %u\n", chip->rates[i]);
+            return -EINVAL;
+        }
+
+        hw->rates |= snd_pcm_rate_to_rate_bit(chip->rates[i]);
+        hw->rate_min = min(hw->rate_min, chip->rates[i]);
+        hw->rate_max = max(hw->rate_max, chip->rates[i]);
+    }
+
+    chip->rate_constraint.list = chip->rates;
+    chip->rate_constraint.count = count;
+
+    pr_info("dma-alsa: %s: %d sample rate(s) configured, %u - %u Hz\n", dev_name(chip->dev), count,
+            hw->rate_min, hw->rate_max);
+    return 0;
+}
+
+/* Set up the hardware frame layout from the tdm_slots and channel_map parameters */
+static int init_slot_layout(void)
+{
+    /*
+    This function is part of the __init() of the module to apply the slot layout, shared by all devices
+        The number of slots is checked, 2 slots fill 1 64-bit word
+        The channel map needs 1 entry per slot, entries beyond the stream channels give silence
+    */
+
+    int i;
+
+    if (tdm_slots < 2 || tdm_slots > DMA_MAX_TDM_SLOTS || tdm_slots % 2) {
+        pr_err("dma-alsa: unsupported tdm_slots: %u\n", tdm_slots);
+        return -EINVAL;
+    }
+
+    if (num_channel_map && num_channel_map != tdm_slots) {
+        pr_err("dma-alsa: channel_map needs %u entries, got %d\n", tdm_slots, num_channel_map);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < num_channel_map; i++) {
+        if (channel_map[i] >= DMA_MAX_TDM_SLOTS) {
+            pr_err("dma-alsa: invalid channel_map entry %d: %u\n", i, channel_map[i]);
+            return -EINVAL;
+        }
+    }
+
+    dma_frame_bytes = tdm_slots / 2 * DMA_WORD_BYTES;
+    dma_pcm_hardware.channels_max = tdm_slots;
+
+    // A DSD player would send real DSD into the native format, it is only offered on request
+    if (!native_format)
+        dma_pcm_hardware.formats &= ~DMA_PCM_FMTBIT_NATIVE;
+
+    pr_info("dma-alsa: %u slots per frame, %u bytes per packed frame\n", tdm_slots, dma_frame_bytes);
+    return 0;
+}
+
+/* Print one interval of the statistics */
+static void dma_stats_show_stat(struct seq_file *m, const char *name, const struct dma_stat *stat)
+{
+    int i;
+
+    if (!stat->count) {
+        seq_printf(m, "%s: no samples\n", name);
+        return;
+    }
+
+    seq_printf(m, "%s: count %llu min %llu avg %llu max %llu ns\n", name, stat->count, stat->min_ns,
+               div64_u64(stat->sum_ns, stat->count), stat->max_ns);
+    seq_puts(m, "  us:");
+    for (i = 0; i < DMA_STATS_HIST_BUCKETS; i++)
+        seq_printf(m, " %s%u:%u", i == DMA_STATS_HIST_BUCKETS - 1 ? ">=" : "<",
+                   i == DMA_STATS_HIST_BUCKETS - 1 ? 1U << (i - 1) : 1U << i, stat->hist[i]);
+    seq_putc(m, '\n');
+}
+
+/* debugfs read of the statistics of a stream */
+static int dma_stats_show(struct seq_file *m, void *v)
+{
+    /*
+    This function is executed when the statistics file is read
+        A snapshot of the statistics is taken, so the DMA callback is not held off while printing
+        The counters, the min headroom and every interval with its histogram are printed
+    */
+
+    struct dma_stream *s = m->private;
+    struct dma_stream_stats snapshot;
+    unsigned long flags;
+    unsigned long xruns = 0;
+    int i;
+
+    spin_lock_irqsave(&s->stats_lock, flags);
+    snapshot = s->stats;
+    spin_unlock_irqrestore(&s->stats_lock, flags);
+
+    for (i = 0; i < DMA_XRUN_CAUSES; i++)
+        xruns += snapshot.xruns[i];
+
+    seq_printf(m, "periods: %lu\n", snapshot.periods);
+    seq_printf(m, "xruns: %lu (no_data %lu, ring_drained %lu, start %lu, submit %lu, overrun %lu, silence %lu)\n",
+               xruns, snapshot.xruns[DMA_XRUN_NO_DATA], snapshot.xruns[DMA_XRUN_RING_DRAINED],
+               snapshot.xruns[DMA_XRUN_START], snapshot.xruns[DMA_XRUN_SUBMIT],
+               snapshot.xruns[DMA_XRUN_OVERRUN], snapshot.xruns[DMA_XRUN_SILENCE]);
+    if (snapshot.min_headroom == LONG_MAX)
+        seq_puts(m, "min_headroom: no samples\n");
+    else
+        seq_printf(m, "min_headroom: %ld frames\n", snapshot.min_headroom);
+
+    dma_stats_show_stat(m, "irq_to_work", &snapshot.irq_to_work);
+    dma_stats_show_stat(m, "pack", &snapshot.pack);
+    dma_stats_show_stat(m, "submit_to_complete", &snapshot.submit_to_complete);
+    return 0;
+}
+
+static int dma_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, dma_stats_show, inode->i_private);
+}
+
+/* debugfs write: any write resets the statistics */
+static ssize_t dma_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+
+    dma_stats_reset(m->private);
+    return count;
+}
+
+static const struct file_operations dma_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = dma_stats_open,
+    .read = seq_read,
+    .write = dma_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+#ifdef DMA_ALSA_SELFTEST
+/*
+ * Selftest and benchmark (built with make SELFTEST=1)
+ *
+ * pack_benchmark runs every packer and unpacker over a synthetic buffer, checks the NEON
+ * packers against the scalar ones and reports ns/frame and MB/s of application data.
+ * For every bound device it then packs into coherent and into noncoherent memory of the
+ * playback DMA device, the latter with the per-slot sync, like the two staging rings.
+ * dma_benchmark is a standalone model of the refill timing on a memcpy channel that stands
+ * in for the audio DMA: a timer at the period rate starts every period from its slot like
+ * the hardware would, the completion queues a work that packs the next one with the scalar
+ * S24_3LE packer. It does not run write_to_buffer(), dma_refill_locked(), the ring accounting
+ * or the statistics of the driver, it measures the scheduling of the refill context: the
+ * completion-to-work latency, the period-to-period jitter, the xruns and the CPU time.
+ */
+
+#define DMA_BENCH_FRAMES 4096               // Frames per packer run of pack_benchmark
+#define DMA_BENCH_ROUNDS 64                 // Runs per packer, the fastest one is reported
+#define DMA_BENCH_SLOTS 2                   // Ring slots of dma_benchmark
+
+static u32 dma_bench_period_frames = 256;   // Period size of dma_benchmark at DMA_REFERENCE_RATE
+static u32 dma_bench_periods = 2000;        // Periods per dma_benchmark run
+
+// One format of pack_benchmark
+struct dma_bench_format {
+    const char *name;
+    unsigned int sample_bytes;
+    dma_pack_fn pack;
+    dma_pack_fn pack_neon;                              // NULL without NEON packers
+    dma_unpack_fn unpack;
+};
+
+#ifdef DMA_HAVE_NEON_PACKERS
+#define DMA_BENCH_NEON(fn) fn
+#else
+#define DMA_BENCH_NEON(fn) NULL
+#endif
+
+static const struct dma_bench_format dma_bench_formats[] = {
+    { "S16_LE", 2, pack_s16_le, DMA_BENCH_NEON(pack_s16_le_neon), unpack_s16_le },
+    { "S24_3LE", 3, pack_s24_3le, DMA_BENCH_NEON(pack_s24_3le_neon), unpack_s24_3le },
+    { "S24_LE", 4, pack_s24_le, DMA_BENCH_NEON(pack_s24_le_neon), unpack_s24_le },
+    { "S32_LE", 4, pack_s32_le, DMA_BENCH_NEON(pack_s32_le_neon), unpack_s32_le },
+};
+
+/* Fill a buffer with a reproducible pattern */
+static void dma_bench_fill(uint8_t *buf, size_t bytes)
+{
+    u32 x = 0x12345678;
+    size_t i;
+
+    for (i = 0; i < bytes; i++) {
+        x = x * 1664525 + 1013904223;
+        buf[i] = x >> 24;
+    }
+}
+
+/* Print the fastest of DMA_BENCH_ROUNDS runs as ns per stereo frame and MB/s of application data */
+static void dma_bench_report(struct seq_file *m, const char *name, const char *kind, u64 best_ns, size_t bytes)
+{
+    seq_printf(m, "%-8s %-11s %4llu.%02llu ns/frame %6llu MB/s\n", name, kind,
+               div_u64(best_ns, DMA_BENCH_FRAMES), div_u64(best_ns * 100, DMA_BENCH_FRAMES) % 100,
+               best_ns ? div64_u64((u64)bytes * 1000, best_ns) : 0);
+}
+
+/* Time one packer, the fastest run counts */
+static u64 dma_bench_pack(dma_pack_fn pack, uint64_t *dst, const uint8_t *src)
+{
+    u64 best = U64_MAX;
+    u64 start;
+    int i;
+
+    for (i = 0; i < DMA_BENCH_ROUNDS; i++) {
+        start = ktime_get_ns();
+        pack(dst, src, DMA_BENCH_FRAMES);
+        best = min(best, ktime_get_ns() - start);
+    }
+
+    return best;
+}
+
+static struct platform_driver dma_alsa_driver;
+
+/* Pack into the coherent and the noncoherent staging memory of the playback DMA device of a bound device */
+static int dma_pack_bench_device(struct device *dev, void *data)
+{
+    /*
+    This function is executed by pack_benchmark for every device bound to the driver
+        The coherent destination is packed like the default staging ring
+        The noncoherent destination is packed and synced to the device per slot, like noncoherent=1
+    */
+
+    size_t bytes = DMA_BENCH_FRAMES * DMA_WORD_BYTES;
+    const struct dma_bench_format *f;
+    struct seq_file *m = data;
+    struct dma_alsa_chip *chip;
+    struct device *dma_dev = NULL;
+    dma_addr_t coherent_addr, noncoherent_addr;
+    uint64_t *coherent, *noncoherent;
+    uint8_t *src;
+    u64 best, start;
+    int i, r;
+
+    // The DMA device is only borrowed while the device stays bound
+    device_lock(dev);
+    chip = dev_get_drvdata(dev);
+    if (chip && chip->streams[SNDRV_PCM_STREAM_PLAYBACK].dma_dev)
+        dma_dev = get_device(chip->streams[SNDRV_PCM_STREAM_PLAYBACK].dma_dev);
+    device_unlock(dev);
+    if (!dma_dev)
+        return 0;
+
+    src = kmalloc(bytes, GFP_KERNEL);
+    coherent = dma_alloc_coherent(dma_dev, bytes, &coherent_addr, GFP_KERNEL);
+    noncoherent = dma_alloc_noncoherent(dma_dev, bytes, &noncoherent_addr, DMA_TO_DEVICE, GFP_KERNEL);
+    if (!src || !coherent || !noncoherent) {
+        seq_printf(m, "%s: out of memory\n", dev_name(dev));
+        goto out;
+    }
+
+    dma_bench_fill(src, bytes);
+    seq_printf(m, "%s: staging memory of %s\n", dev_name(dev), dev_name(dma_dev));
+
+    for (i = 0; i < ARRAY_SIZE(dma_bench_formats); i++) {
+        f = &dma_bench_formats[i];
+
+        best = dma_bench_pack(f->pack, coherent, src);
+        dma_bench_report(m, f->name, "coherent", best, DMA_BENCH_FRAMES * 2 * f->sample_bytes);
+
+        best = U64_MAX;
+        for (r = 0; r < DMA_BENCH_ROUNDS; r++) {
+            start = ktime_get_ns();
+            f->pack(noncoherent, src, DMA_BENCH_FRAMES);
+            dma_sync_single_for_device(dma_dev, noncoherent_addr, bytes, DMA_TO_DEVICE);
+            best = min(best, ktime_get_ns() - start);
+        }
+        dma_bench_report(m, f->name, "noncoherent", best, DMA_BENCH_FRAMES * 2 * f->sample_bytes);
+    }
+
+out:
+    if (noncoherent)
+        dma_free_noncoherent(dma_dev, bytes, noncoherent, noncoherent_addr, DMA_TO_DEVICE);
+    if (coherent)
+        dma_free_coherent(dma_dev, bytes, coherent, coherent_addr);
+    kfree(src);
+    put_device(dma_dev);
+    return 0;
+}
+
+/* debugfs read of pack_benchmark */
+static int dma_pack_bench_show(struct seq_file *m, void *v)
+{
+    /*
+    This function is executed when pack_benchmark is read, it runs in process context
+        Every format is packed and unpacked DMA_BENCH_ROUNDS times over DMA_BENCH_FRAMES stereo frames
+        The NEON packers must give the same words as the scalar packers, a mismatch is reported
+        The staging memory of every bound device is compared last, coherent against noncoherent
+    */
+
+    const struct dma_bench_format *f;
+    uint8_t *src, *back;
+    uint64_t *dst, *ref;
+    u64 best, start;
+    size_t src_bytes;
+    int i, r;
+
+    src = kmalloc(DMA_BENCH_FRAMES * DMA_WORD_BYTES, GFP_KERNEL);
+    back = kmalloc(DMA_BENCH_FRAMES * DMA_WORD_BYTES, GFP_KERNEL);
+    dst = kmalloc(DMA_BENCH_FRAMES * DMA_WORD_BYTES, GFP_KERNEL);
+    ref = kmalloc(DMA_BENCH_FRAMES * DMA_WORD_BYTES, GFP_KERNEL);
+    if (!src || !back || !dst || !ref)
+        goto out;
+
+    dma_bench_fill(src, DMA_BENCH_FRAMES * DMA_WORD_BYTES);
+
+    for (i = 0; i < ARRAY_SIZE(dma_bench_formats); i++) {
+        f = &dma_bench_formats[i];
+        src_bytes = DMA_BENCH_FRAMES * 2 * f->sample_bytes;
+
+        best = dma_bench_pack(f->pack, ref, src);
+        dma_bench_report(m, f->name, "pack", best, src_bytes);
+
+        if (f->pack_neon) {
+            best = dma_bench_pack(f->pack_neon, dst, src);
+            dma_bench_report(m, f->name, "pack neon", best, src_bytes);
+            if (memcmp(dst, ref, DMA_BENCH_FRAMES * DMA_WORD_BYTES))
+                seq_printf(m, "%-8s pack neon   MISMATCH with the scalar packer\n", f->name);
+        }
+
+        best = U64_MAX;
+        for (r = 0; r < DMA_BENCH_ROUNDS; r++) {
+            start = ktime_get_ns();
+            f->unpack(back, ref, DMA_BENCH_FRAMES);
+            best = min(best, ktime_get_ns() - start);
+        }
+        dma_bench_report(m, f->name, "unpack", best, src_bytes);
+    }
+
+    driver_for_each_device(&dma_alsa_driver.driver, NULL, m, dma_pack_bench_device);
+
+out:
+    kfree(src);
+    kfree(back);
+    kfree(dst);
+    kfree(ref);
+    return 0;
+}
+
+static int dma_pack_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, dma_pack_bench_show, NULL);
+}
+
+static const struct file_operations dma_pack_bench_fops = {
+    .owner = THIS_MODULE,
+    .open = dma_pack_bench_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// State of one dma_benchmark run
+struct dma_bench {
+    struct dma_chan *chan;                              // memcpy channel standing in for the audio DMA
+    struct hrtimer timer;                               // Starts every period, like the hardware clock
+    struct work_struct work;                            // Refill work, packs the slots the DMA completed
+    struct completion done;
+    uint8_t *src;                                       // Synthetic S24_3LE application data of 1 period
+    uint64_t *ring;                                     // Packed slots, the memcpy source
+    dma_addr_t ring_addr;
+    void *sink;                                         // memcpy destination, stands in for the FIFO of the device
+    dma_addr_t sink_addr;
+    size_t period_bytes;                                // Packed period size
+    snd_pcm_uframes_t period_frames;
+    u64 period_ns;
+    unsigned int periods;                               // Periods of the run
+    unsigned int ticks;                                 // Periods started by the timer
+    unsigned int refill_slot;                           // Next slot packed by the refill work
+    unsigned long ready;                                // Bit per slot: packed, waiting for its period
+    atomic_t completed;                                 // Periods completed by the DMA, not refilled yet
+    u64 complete_ns;                                    // Completion time of the oldest period not refilled
+    u64 last_work_ns;                                   // Start of the previous refill
+    u64 work_ns;                                        // CPU time spent in the refill work
+    unsigned long xruns;                                // Periods whose slot was not packed in time
+    struct dma_stat irq_to_work;
+    struct dma_stat jitter;                             // Deviation of the refill interval from the period
+};
+
+/* DMA completion of dma_benchmark, in interrupt context like dma_transfer_callback() */
+static void dma_bench_complete(void *param)
+{
+    struct dma_bench *b = param;
+
+    if (!READ_ONCE(b->complete_ns))
+        WRITE_ONCE(b->complete_ns, ktime_get_ns());
+    atomic_inc(&b->completed);
+    queue_work(refill_mode == DMA_REFILL_SYSTEM_WQ ? system_wq : system_highpri_wq, &b->work);
+}
+
+/* Timer of dma_benchmark: the hardware reaches the next slot */
+static enum hrtimer_restart dma_bench_tick(struct hrtimer *timer)
+{
+    struct dma_bench *b = container_of(timer, struct dma_bench, timer);
+    unsigned int slot = b->ticks % DMA_BENCH_SLOTS;
+    struct dma_async_tx_descriptor *desc;
+
+    if (b->ticks++ == b->periods) {
+        complete(&b->done);
+        return HRTIMER_NORESTART;
+    }
+
+    // The slot has to be packed by now, like a ring slot before the hardware plays it
+    desc = NULL;
+    if (test_and_clear_bit(slot, &b->ready))
+        desc = dmaengine_prep_dma_memcpy(b->chan, b->sink_addr, b->ring_addr + slot * b->period_bytes,
+                                         b->period_bytes, DMA_PREP_INTERRUPT);
+    if (desc) {
+        desc->callback = dma_bench_complete;
+        desc->callback_param = b;
+        dmaengine_submit(desc);
+        dma_async_issue_pending(b->chan);
+    } else {
+        b->xruns++;
+    }
+
+    hrtimer_forward_now(timer, ns_to_ktime(b->period_ns));
+    return HRTIMER_RESTART;
+}
+
+/* Refill work of dma_benchmark: pack the completed slots again */
+static void dma_bench_refill(struct work_struct *work)
+{
+    struct dma_bench *b = container_of(work, struct dma_bench, work);
+    u64 start = ktime_get_ns();
+    unsigned int completed = atomic_xchg(&b->completed, 0);
+    u64 complete_ns = xchg(&b->complete_ns, 0);
+
+    // A completion between the two exchanges is handled now, the run it queued finds no timestamp
+    // The intervals are only written here and read after the run, the bench needs no lock on them
+    if (complete_ns)
+        dma_stat_add(&b->irq_to_work, start - complete_ns);
+    if (b->last_work_ns)
+        dma_stat_add(&b->jitter, abs((s64)(start - b->last_work_ns - b->period_ns)));
+    b->last_work_ns = start;
+
+    while (completed--) {
+        pack_s24_3le(b->ring + b->refill_slot * b->period_frames, b->src, b->period_frames);
+        set_bit(b->refill_slot, &b->ready);
+        b->refill_slot = (b->refill_slot + 1) % DMA_BENCH_SLOTS;
+    }
+
+    b->work_ns += ktime_get_ns() - start;
+}
+
+/* debugfs read of dma_benchmark */
+static int dma_bench_show(struct seq_file *m, void *v)
+{
+    /*
+    This function is executed when dma_benchmark is read, it blocks for the whole run
+        A memcpy channel and 2 packed slots of bench_period_frames stereo frames are set up
+        bench_periods periods are run at the period rate of DMA_REFERENCE_RATE
+        The refill runs on the system workqueue, or the high-priority one for the other refill modes
+    */
+
+    struct dma_bench *b;
+    struct device *dev;
+    dma_cap_mask_t mask;
+    u64 total_ns;
+
+    b = kzalloc(sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return -ENOMEM;
+
+    dma_cap_zero(mask);
+    dma_cap_set(DMA_MEMCPY, mask);
+    b->chan = dma_request_chan_by_mask(&mask);
+    if (IS_ERR(b->chan)) {
+        seq_puts(m, "no memcpy dma channel available\n");
+        kfree(b);
+        return 0;
+    }
+    dev = b->chan->device->dev;
+
+    b->period_frames = clamp_t(u32, dma_bench_period_frames, 16, DMA_PERIOD_BYTES_MAX / DMA_WORD_BYTES);
+    b->period_bytes = b->period_frames * DMA_WORD_BYTES;
+    b->period_ns = div_u64((u64)b->period_frames * NSEC_PER_SEC, DMA_REFERENCE_RATE);
+    b->periods = max(dma_bench_periods, 1U);
+    b->src = kmalloc(b->period_frames * 6, GFP_KERNEL);
+    b->ring = dma_alloc_coherent(dev, DMA_BENCH_SLOTS * b->period_bytes, &b->ring_addr, GFP_KERNEL);
+    b->sink = dma_alloc_coherent(dev, b->period_bytes, &b->sink_addr, GFP_KERNEL);
+    if (!b->src || !b->ring || !b->sink) {
+        seq_puts(m, "out of memory\n");
+        goto out;
+    }
+
+    dma_bench_fill(b->src, b->period_frames * 6);
+    pack_s24_3le(b->ring, b->src, b->period_frames);
+    pack_s24_3le(b->ring + b->period_frames, b->src, b->period_frames);
+    b->ready = BIT(DMA_BENCH_SLOTS) - 1;
+    b->irq_to_work.min_ns = U64_MAX;
+    b->jitter.min_ns = U64_MAX;
+    atomic_set(&b->completed, 0);
+    INIT_WORK(&b->work, dma_bench_refill);
+    init_completion(&b->done);
+
+    hrtimer_init(&b->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    b->timer.function = dma_bench_tick;
+    hrtimer_start(&b->timer, ns_to_ktime(b->period_ns), HRTIMER_MODE_REL);
+    wait_for_completion(&b->done);
+
+    dmaengine_terminate_sync(b->chan);
+    flush_work(&b->work);
+    total_ns = (u64)b->periods * b->period_ns;
+
+    seq_printf(m, "channel: %s\n", dma_chan_name(b->chan));
+    seq_printf(m, "period: %lu frames, %llu ns\n", b->period_frames, b->period_ns);
+    seq_printf(m, "periods: %u\n", b->periods);
+    seq_printf(m, "xruns: %lu\n", b->xruns);
+    seq_printf(m, "refill_cpu: %llu.%02llu %%\n", div64_u64(b->work_ns * 100, total_ns),
+               div64_u64(b->work_ns * 10000, total_ns) % 100);
+    dma_stats_show_stat(m, "irq_to_work", &b->irq_to_work);
+    dma_stats_show_stat(m, "jitter", &b->jitter);
+
+out:
+    if (b->sink)
+        dma_free_coherent(dev, b->period_bytes, b->sink, b->sink_addr);
+    if (b->ring)
+        dma_free_coherent(dev, DMA_BENCH_SLOTS * b->period_bytes, b->ring, b->ring_addr);
+    kfree(b->src);
+    dma_release_channel(b->chan);
+    kfree(b);
+    return 0;
+}
+
+static int dma_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, dma_bench_show, NULL);
+}
+
+static const struct file_operations dma_bench_fops = {
+    .owner = THIS_MODULE,
+    .open = dma_bench_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* Create the selftest files in the debugfs directory of the module */
+static void init_selftest(void)
+{
+    debugfs_create_file("pack_benchmark", 0444, dma_debugfs_root, NULL, &dma_pack_bench_fops);
+    debugfs_create_file("dma_benchmark", 0444, dma_debugfs_root, NULL, &dma_bench_fops);
+    debugfs_create_u32("bench_period_frames", 0644, dma_debugfs_root, &dma_bench_period_frames);
+    debugfs_create_u32("bench_periods", 0644, dma_debugfs_root, &dma_bench_periods);
+}
+#else
+static void init_selftest(void)
+{
 }
+#endif
 
-/* Initialize the DMA channel */
-static int init_dma_channel(void)
+/* Create the debugfs directory of a device with the statistics files */
+static void init_debugfs(struct dma_alsa_chip *chip)
 {
     /*
-    This function is part of the __init() of the module to init the dma channel
-        A DMA channel is requested taking into account the parameters set in the mask
-        Every kind of DMA channel can be requested here, this module uses the channel to AXI DMA in hardware
+    This function is part of the probe of a device, once the card is registered
+        Every device gets a directory named after it below the directory of the module
+        debugfs is optional, failures are not fatal and not checked as the debugfs API intends
     */
 
-    dma_cap_mask_t mask;
-    dma_cap_zero(mask);
-    dma_cap_set(DMA_SLAVE|DMA_PRIVATE, mask);
-    dma_channel = dma_request_channel(mask, NULL, "dma0chan0");
-    if (IS_ERR(dma_channel)) {
-        pr_err("dma-alsa: couldnt request the dma channel\n");
-        return PTR_ERR(dma_channel);
-    }
+    struct dma_stream *capture = &chip->streams[SNDRV_PCM_STREAM_CAPTURE];
 
-    pr_info("dma-alsa: dma channel obtained: %s\n", dma_channel->device->dev->kobj.name);
-    return 0;
+    chip->debugfs_dir = debugfs_create_dir(dev_name(chip->dev), dma_debugfs_root);
+    debugfs_create_file("playback_stats", 0644, chip->debugfs_dir,
+                        &chip->streams[SNDRV_PCM_STREAM_PLAYBACK], &dma_stats_fops);
+    if (capture->dma_channel)
+        debugfs_create_file("capture_stats", 0644, chip->debugfs_dir, capture, &dma_stats_fops);
 }
 
-/* Function to start the DMA transfer */
-static int start_dma_transfer(void *src, size_t len, dma_addr_t phys_addr)
-{
-    /*
-    This function is executed in write_to_buffer() to start a dma transfer
-        A descriptor for the transfer is configured
-        The callback for completion of the transfer is configured
-    */
+/*
+ * Mixer controls
+ *
+ * Playback volume and switch per ALSA channel, applied by the packer as a fixed-point gain.
+ * The volume runs in 0.5 dB steps from mute to 0 dB, there is no boost so the packed
+ * samples never clip. The native format is not packed by the CPU and plays without volume.
+ */
 
-    struct dma_async_tx_descriptor *desc;
-    dma_cookie_t cookie;
+static const DECLARE_TLV_DB_SCALE(dma_volume_tlv, -6000, 50, 1);
 
-    if (!dma_channel) {
-        pr_err("dma-alsa: dma_channel is NULL, cannot start transfer\n");
-        return -EINVAL;
-    }
+/* Gain of a mixer volume, 0 mutes */
+static u32 dma_volume_gain(unsigned int volume)
+{
+    // Attenuation in 0.5 dB steps, split into a step inside 6 dB and a multiple of 6 dB, in Q24
+    static const u32 fine[12] = {
+        16777216, 15838713, 14952709, 14116268, 13326616, 12581137,
+        11877359, 11212950, 10585708, 9993552, 9434522, 8906763,
+    };
+    static const u32 coarse[DMA_VOLUME_MAX / 12] = {
+        16777216, 8408526, 4214246, 2112126, 1058571, 530542, 265901, 133266, 66791, 33475,
+    };
+    unsigned int atten = DMA_VOLUME_MAX - volume;
+
+    if (!volume)
+        return 0;
+
+    return (u64)fine[atten % 12] * coarse[atten / 12] >> DMA_GAIN_SHIFT;
+}
 
-    if (!src) {
-        pr_err("dma-alsa: source buffer is NULL, cannot start transfer\n");
-        return -EINVAL;
+/* Derive the gains of the packer from the mixer controls */
+static void dma_update_gain(struct dma_alsa_chip *chip)
+{
+    bool unity = true;
+    unsigned int i;
+    u32 gain;
+
+    for (i = 0; i < tdm_slots; i++) {
+        gain = chip->volume_on[i] ? dma_volume_gain(chip->volume[i]) : 0;
+        WRITE_ONCE(chip->gain[i], gain);
+        unity &= gain == DMA_GAIN_UNITY;
     }
 
-    desc = dmaengine_prep_slave_single(dma_channel, phys_addr, len, DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT);
-    if (!desc) {
-        pr_err("dma-alsa: could not prepare the dma descriptor\n");
-        return -EINVAL;
-    }
+    WRITE_ONCE(chip->gain_unity, unity);
+}
 
-    desc->callback = dma_transfer_callback;
-    desc->callback_param = src;
+static int dma_volume_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count = tdm_slots;
+    uinfo->value.integer.min = 0;
+    uinfo->value.integer.max = DMA_VOLUME_MAX;
+    return 0;
+}
 
-    cookie = dmaengine_submit(desc);
-    if (dma_submit_error(cookie)) {
-        pr_err("dma-alsa: dma transfer submission failed\n");
-        return -EINVAL;
+static int dma_volume_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    struct dma_alsa_chip *chip = snd_kcontrol_chip(kcontrol);
+    unsigned int i;
+
+    for (i = 0; i < tdm_slots; i++)
+        ucontrol->value.integer.value[i] = chip->volume[i];
+    return 0;
+}
+
+static int dma_volume_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    struct dma_alsa_chip *chip = snd_kcontrol_chip(kcontrol);
+    unsigned int i;
+    int changed = 0;
+
+    for (i = 0; i < tdm_slots; i++)
+        if (ucontrol->value.integer.value[i] < 0 || ucontrol->value.integer.value[i] > DMA_VOLUME_MAX)
+            return -EINVAL;
+
+    for (i = 0; i < tdm_slots; i++) {
+        if (chip->volume[i] != ucontrol->value.integer.value[i]) {
+            chip->volume[i] = ucontrol->value.integer.value[i];
+            changed = 1;
+        }
     }
 
-    dma_async_issue_pending(dma_channel);
+    if (changed)
+        dma_update_gain(chip);
+    return changed;
+}
 
-    pr_info("dma-alsa: dma transfer started for buffer at %p, length: %zu bytes\n", src, len);
+static int dma_switch_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_BOOLEAN;
+    uinfo->count = tdm_slots;
+    uinfo->value.integer.min = 0;
+    uinfo->value.integer.max = 1;
     return 0;
 }
 
-/* Write audio from ALSA buffer to dma_buffer */
-// This function can safely use mutex and ALSA functions since it's called from non-atomic context (work handler or trigger start)
-static void write_to_buffer(struct snd_pcm_substream *substream)
+static int dma_switch_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
 {
-    /*
-    This function is executed in the work handler to add and zero pad the new data to the DMA buffer
-        The received data from the ALSA buffer is zero padded and combined to an L/R sample in 1 word in memory (64 bit or 8 bytes)
-        The processed data, 1 period, is then transferred with the DMA
-    */
+    struct dma_alsa_chip *chip = snd_kcontrol_chip(kcontrol);
+    unsigned int i;
 
-    if (dma_state != DMA_ALSA_STATE_RUNNING) {
-        pr_info("dma-alsa: not in RUNNING state, skipping write_to_buffer\n");
-        return;
-    }
-    if(substream == NULL) {
-        pr_err("dma-alsa: substream NULL in write");
-        return;
-    }
-    struct snd_pcm_runtime *runtime = substream->runtime;
-    snd_pcm_sframes_t available_frames;
-    void *src;
-    size_t i;
-    uint8_t *src_byte;
-    uint64_t *dst;
-    int processed = 0;
-    size_t period_bytes = frames_to_bytes(runtime, runtime->period_size);
+    for (i = 0; i < tdm_slots; i++)
+        ucontrol->value.integer.value[i] = chip->volume_on[i];
+    return 0;
+}
 
-    if(runtime == NULL) {
-        pr_err("dma-alsa: runtime NULL in write");
-        return;
+static int dma_switch_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+    struct dma_alsa_chip *chip = snd_kcontrol_chip(kcontrol);
+    unsigned int i;
+    int changed = 0;
+
+    for (i = 0; i < tdm_slots; i++) {
+        if (chip->volume_on[i] != !!ucontrol->value.integer.value[i]) {
+            chip->volume_on[i] = !!ucontrol->value.integer.value[i];
+            changed = 1;
+        }
     }
 
-    if(dma_buffer == NULL) {
-        pr_err("dma-alsa: dma buffer NULL in write");
-        return;
-    }
+    if (changed)
+        dma_update_gain(chip);
+    return changed;
+}
 
-    mutex_lock(&dma_lock);
+static const struct snd_kcontrol_new dma_controls[] = {
+    {
+        .iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+        .name = "PCM Playback Volume",
+        .access = SNDRV_CTL_ELEM_ACCESS_READWRITE | SNDRV_CTL_ELEM_ACCESS_TLV_READ,
+        .info = dma_volume_info,
+        .get = dma_volume_get,
+        .put = dma_volume_put,
+        .tlv.p = dma_volume_tlv,
+    },
+    {
+        .iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+        .name = "PCM Playback Switch",
+        .info = dma_switch_info,
+        .get = dma_switch_get,
+        .put = dma_switch_put,
+    },
+};
 
-    available_frames = runtime->control->appl_ptr - driver_hw_ptr;
-    if (available_frames < 0)
-        available_frames += runtime->buffer_size;
+/* Add the mixer controls of a device, every channel starts at 0 dB and unmuted */
+static int init_controls(struct dma_alsa_chip *chip)
+{
+    unsigned int i;
+    int err;
 
-    if (available_frames < (snd_pcm_sframes_t)runtime->period_size) {
-        pr_info("dma-alsa: underrun detected in write_to_buffer\n");
-        snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
-        mutex_unlock(&dma_lock);
-        return;
+    for (i = 0; i < tdm_slots; i++) {
+        chip->volume[i] = DMA_VOLUME_MAX;
+        chip->volume_on[i] = true;
     }
+    dma_update_gain(chip);
 
-    int sample_size;
-    if (runtime->format == SNDRV_PCM_FORMAT_S24_3LE) {
-        sample_size = 3;
-    } else if (runtime->format == SNDRV_PCM_FORMAT_S24_LE) {
-        sample_size = 4;
-    } else {
-        pr_err("dma-alsa: unsupported runtime format in write_to_buffer\n");
-        mutex_unlock(&dma_lock);
-        return;
+    for (i = 0; i < ARRAY_SIZE(dma_controls); i++) {
+        err = snd_ctl_add(chip->card, snd_ctl_new1(&dma_controls[i], chip));
+        if (err < 0)
+            return err;
     }
 
-    int frame_bytes = sample_size * runtime->channels;
-
+    return 0;
+}
 
-    src = runtime->dma_area + frames_to_bytes(runtime, driver_hw_ptr);
+/* Set up the state of a stream */
+static void init_stream(struct dma_alsa_chip *chip, int direction)
+{
+    struct dma_stream *s = &chip->streams[direction];
+    int i;
+
+    s->chip = chip;
+    s->direction = direction;
+    s->name = direction == SNDRV_PCM_STREAM_CAPTURE ? "capture" : "playback";
+    s->dma_dir = direction == SNDRV_PCM_STREAM_CAPTURE ? DMA_DEV_TO_MEM : DMA_MEM_TO_DEV;
+    s->dma_state = DMA_ALSA_STATE_STOPPED;
+    spin_lock_init(&s->ring_lock);
+    seqcount_spinlock_init(&s->ring_seq, &s->ring_lock);
+    spin_lock_init(&s->stats_lock);
+    INIT_WORK(&s->dma_work, dma_work_handler);
+    kthread_init_work(&s->dma_kwork, dma_kwork_handler);
+    atomic_set(&s->periods_completed, 0);
+    dma_stats_reset(s);
+
+    for (i = 0; i < DMA_MAX_PERIODS; i++) {
+        s->ring_slot[i].stream = s;
+        s->ring_slot[i].index = i;
+    }
+}
 
-    dst = (uint64_t *)dma_buffer;
-    src_byte = (uint8_t *)src;
-    buffer_fill_level = 0;
+/* Release the DMA buffers and channels of all streams of a device */
+static void release_streams(struct dma_alsa_chip *chip)
+{
+    int i;
 
-    for (i = 0; i < period_bytes; i += frame_bytes) {
-        uint64_t word = 0;
+    for (i = 0; i < ARRAY_SIZE(chip->streams); i++) {
+        struct dma_stream *s = &chip->streams[i];
 
-        if (sample_size == 3) {
-            for (int j = 0; j < 6; j++) {
-                word |= ((uint64_t)src_byte[processed+j]) << (8 * (5 - j));
-            }
-            word <<= 16;
-            processed += 6;
-        } else {
-            word |= ((uint64_t)src_byte[processed+0]) << 40; // L1
-            word |= ((uint64_t)src_byte[processed+1]) << 32; // L2
-            word |= ((uint64_t)src_byte[processed+2]) << 24; // L3
-            word |= ((uint64_t)src_byte[processed+4]) << 16; // R1
-            word |= ((uint64_t)src_byte[processed+5]) << 8;  // R2
-            word |= ((uint64_t)src_byte[processed+6]);       // R3
+        if (s->dma_buffer.area) {
+            snd_dma_free_pages(&s->dma_buffer);
+            memset(&s->dma_buffer, 0, sizeof(s->dma_buffer));
+            pr_info("dma-alsa: %s dma buffer released\n", s->name);
+        }
 
-            word <<= 16;
-            processed += 8;
+        if (s->dma_channel) {
+            dma_release_channel(s->dma_channel);
+            s->dma_channel = NULL;
+            pr_info("dma-alsa: %s dma channel released\n", s->name);
         }
 
-        *dst = word;
-        dst++;
-        buffer_fill_level += 8; 
+        // Last, the buffers of the card and the staging ring are gone
+        if (s->dma_dev) {
+            put_device(s->dma_dev);
+            s->dma_dev = NULL;
+        }
     }
+}
 
-    if (start_dma_transfer(dma_buffer, buffer_fill_level, dma_handle)) {
-        pr_err("dma-alsa: failed to start DMA for period in write_to_buffer\n");
-        // If this fails, we can stop the stream
-        snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
-    }
+/* Release the DMA channels of a device, the DMA buffers stay */
+static void release_dma_channels(struct dma_alsa_chip *chip)
+{
+    int i;
 
-    mutex_unlock(&dma_lock);
+    for (i = 0; i < ARRAY_SIZE(chip->streams); i++) {
+        struct dma_stream *s = &chip->streams[i];
+
+        if (!s->dma_channel)
+            continue;
+
+        dmaengine_terminate_sync(s->dma_channel);
+        dma_stream_sync(s);
+        dma_release_channel(s->dma_channel);
+        s->dma_channel = NULL;
+    }
 }
 
-/* PCM open callback */
-static int dma_pcm_open(struct snd_pcm_substream *substream)
+/* Runtime suspend: release the DMA channels of an idle device */
+static int dma_alsa_runtime_suspend(struct device *dev)
 {
     /*
-    This callback is executed when an application opens the PCM device
-        The pcm hardware specific parameters dma_pcm_hardware are set
-        1 DMA buffer of AUDIO_BUFFER_SIZE is allocated and set to use
-        The hardware pointer is reset
+    This function is executed autosuspend_ms after the last close, or at system suspend
+        No stream is running, the callbacks and refill work of the last transfers are waited for
+        The channels are released, so the DMA engine can gate its clocks
+        The DMA buffers were allocated from the DMA devices at probe and stay allocated, the devices stay referenced
     */
 
-    struct snd_pcm_runtime *runtime = substream->runtime;
-    runtime->hw = dma_pcm_hardware;
-
-    dma_buffer = dma_alloc_coherent(dma_channel->device->dev, AUDIO_BUFFER_SIZE, &dma_handle, GFP_KERNEL);
-    if (!dma_buffer) {
-        pr_err("dma-alsa: could not allocate dma_buffer\n");
-        return -ENOMEM;
-    }
-
-    g_substream = substream;
-    driver_hw_ptr = 0;
+    struct dma_alsa_chip *chip = dev_get_drvdata(dev);
 
-    pr_info("dma-alsa: PCM opened, DMA buffer allocated at %p\n", dma_buffer);
+    release_dma_channels(chip);
+    pr_debug("dma-alsa: %s: idle, dma channels released\n", dev_name(dev));
     return 0;
 }
 
-/* PCM close callback */
-static int dma_pcm_close(struct snd_pcm_substream *substream)
+/* Runtime resume: request the DMA channels again for the first open */
+static int dma_alsa_runtime_resume(struct device *dev)
 {
     /*
-    This callback is executed when an application closes the PCM device
-        The mutex lock is requested to release the dma buffers
-        1 ALSA buffer is released
-        1 DMA buffer is released
-        The global substream pointer is dereferenced
+    This function is executed by the first open after a runtime suspend, or at system resume with a stream open
+        Every stream the PCM was created with gets its channel back, by the names of the probe
+        The capabilities of the channel are read again, the driver configures nothing else on it
     */
 
-    mutex_lock(&dma_lock);
+    struct dma_alsa_chip *chip = dev_get_drvdata(dev);
+    int i, err;
 
-    snd_pcm_lib_free_pages(substream);
+    for (i = 0; i < ARRAY_SIZE(chip->streams); i++) {
+        if (!chip->pcm->streams[i].substream_count || chip->streams[i].dma_channel)
+            continue;
 
-    if (dma_buffer) {
-        dma_free_coherent(dma_channel->device->dev, AUDIO_BUFFER_SIZE, dma_buffer, dma_handle);
-        dma_buffer = NULL;
+        err = request_stream_channel(&chip->streams[i]);
+        if (err) {
+            release_dma_channels(chip);
+            return err;
+        }
     }
 
-    mutex_unlock(&dma_lock);
+    return 0;
+}
+
+/* System suspend: the PCM core suspended the streams already, the channels go as at runtime suspend */
+static int dma_alsa_suspend(struct device *dev)
+{
+    struct dma_alsa_chip *chip = dev_get_drvdata(dev);
+
+    snd_power_change_state(chip->card, SNDRV_CTL_POWER_D3hot);
+    return pm_runtime_force_suspend(dev);
+}
+
+/* System resume: the channels come back when a stream is open, the streams resume by trigger */
+static int dma_alsa_resume(struct device *dev)
+{
+    struct dma_alsa_chip *chip = dev_get_drvdata(dev);
+    int err;
 
-    g_substream = NULL;
+    err = pm_runtime_force_resume(dev);
+    if (err)
+        return err;
 
+    snd_power_change_state(chip->card, SNDRV_CTL_POWER_D0);
     return 0;
 }
 
-/* PCM hw_params callback */
-static int dma_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *params)
+static const struct dev_pm_ops dma_alsa_pm_ops = {
+    SYSTEM_SLEEP_PM_OPS(dma_alsa_suspend, dma_alsa_resume)
+    RUNTIME_PM_OPS(dma_alsa_runtime_suspend, dma_alsa_runtime_resume, NULL)
+};
+
+/* Bind a device: 1 sound card on the channels of 1 AXI DMA core */
+static int dma_alsa_probe(struct platform_device *pdev)
 {
     /*
-    This callback is executed when new parameters of the pcm device need to be set
-        The requested parameters are checked against what the module supports
-        The requested period size is set
-        The requested buffer size is set
-        An ALSA buffer is allocated
+    This function is executed for every device tree node of the driver, or the legacy device
+        The private state of the device is allocated, it holds the playback and capture streams
+        The rates are taken from the device tree or the rates parameter
+        The DMA channels are requested, capture is left out when its channel is missing
+        The DMA buffers of the staging rings are preallocated
+        The refill workqueue or thread of the device is created
+        A new sound card with a pcm device is created for the device
+        The callback functions for this sound card are set
+        The playback volume and switch controls are added
+        The managed ALSA buffers are preallocated from the DMA devices
+        Runtime PM is enabled, it releases the channels once the device is idle
+        The sound card is registered with the system
+        The statistics are exposed in debugfs
     */
 
-    struct snd_pcm_runtime *runtime = substream->runtime;
-    unsigned int requested_buffer_size = params_buffer_bytes(params);
-    unsigned int requested_period_size = params_period_bytes(params);
-
-    if (!runtime) {
-        pr_err("dma-alsa: runtime is NULL\n");
-        return -EINVAL;
-    }
-
-    if (params_format(params) != SNDRV_PCM_FORMAT_S24_3LE && params_format(params) != SNDRV_PCM_FORMAT_S24_LE) {
-        pr_err("dma-alsa: unsupported format requested: %d\n", params_format(params));
-        return -EINVAL;
-    }
+    struct dma_alsa_chip *chip;
+    struct dma_stream *playback;
+    struct dma_stream *capture;
+    struct snd_card *card;
+    int err;
 
-    if (params_rate(params) != 48000) {
-        pr_err("dma-alsa: unsupported sample rate requested: %u\n", params_rate(params));
-        return -EINVAL;
-    }
+    chip = devm_kzalloc(&pdev->dev, sizeof(*chip), GFP_KERNEL);
+    if (!chip)
+        return -ENOMEM;
 
-    if (params_channels(params) != 2) {
-        pr_err("dma-alsa: unsupported number of channels: %u\n", params_channels(params));
-        return -EINVAL;
-    }
+    chip->dev = &pdev->dev;
+    platform_set_drvdata(pdev, chip);
 
-    if (requested_buffer_size > AUDIO_BUFFER_SIZE) {
-        pr_warn("dma-alsa: requested buffer_size too large, adjusting to %u\n", AUDIO_BUFFER_SIZE);
-        requested_buffer_size = AUDIO_BUFFER_SIZE;
-    }
+    init_stream(chip, SNDRV_PCM_STREAM_PLAYBACK);
+    init_stream(chip, SNDRV_PCM_STREAM_CAPTURE);
+    playback = &chip->streams[SNDRV_PCM_STREAM_PLAYBACK];
+    capture = &chip->streams[SNDRV_PCM_STREAM_CAPTURE];
 
-    if (requested_period_size < dma_pcm_hardware.period_bytes_min ||
-        requested_period_size > dma_pcm_hardware.period_bytes_max) {
-        pr_warn("dma-alsa: requested period_size out of bounds, adjusting to %zu\n",
-                dma_pcm_hardware.period_bytes_min);
-        requested_period_size = dma_pcm_hardware.period_bytes_min;
-    }
+    err = init_rates(chip);
+    if (err)
+        return err;
 
-    if (requested_buffer_size < (requested_period_size * dma_pcm_hardware.periods_min)) {
-        pr_err("dma-alsa: buffer_size too small for requested period_size\n");
-        return -EINVAL;
-    }
+    err = request_stream_channel(playback);
+    if (err)
+        return err;
 
-    if (snd_pcm_lib_malloc_pages(substream, requested_buffer_size) < 0) {
-        pr_err("dma-alsa: Failed to allocate ALSA buffer\n");
-        return -ENOMEM;
+    // Capture is optional, playback works on its own
+    if (dev_of_node(chip->dev) || (capture_channel && *capture_channel)) {
+        err = request_stream_channel(capture);
+        if (err == -EPROBE_DEFER) {
+            release_streams(chip);
+            return err;
+        }
+        if (err)
+            pr_warn("dma-alsa: %s: no capture dma channel, registering playback only\n", dev_name(chip->dev));
     }
 
-    runtime->frame_bits = params_channels(params) * snd_pcm_format_physical_width(params_format(params));
-    runtime->period_size = bytes_to_frames(runtime, requested_period_size);
-    runtime->buffer_size = bytes_to_frames(runtime, requested_buffer_size);
-
-    pr_info("dma-alsa: hw_params configured, buffer_size=%zu frames, period_size=%zu frames, address=%p\n",
-            runtime->buffer_size, runtime->period_size, runtime->dma_area);
+    // The staging rings are allocated once, while memory is not fragmented yet
+    err = dma_reserve_staging(playback, DMA_STAGING_PREALLOC);
+    if (!err && capture->dma_channel)
+        err = dma_reserve_staging(capture, DMA_STAGING_PREALLOC);
+    if (err)
+        goto err_release;
 
-    return 0;
-}
+    err = init_refill_context(chip);
+    if (err)
+        goto err_release;
 
-/* PCM pointer callback */
-static snd_pcm_uframes_t dma_pcm_pointer(struct snd_pcm_substream *substream)
-{
-    /*
-    This callback is executed whenever the application wants to know where the hardware
-    is currently located in the ALSA ringbuffer = the hardware pointer
-    */
+    err = snd_card_new(chip->dev, -1, NULL, THIS_MODULE, 0, &card);
+    if (err < 0)
+        goto err_release;
 
-    snd_pcm_uframes_t hw_ptr = driver_hw_ptr;
+    chip->card = card;
+    card->private_data = chip;
+    snprintf(card->driver, sizeof(card->driver), CARD_NAME);
+    snprintf(card->shortname, sizeof(card->shortname), CARD_NAME);
+    snprintf(card->longname, sizeof(card->longname), "%s at %s", CARD_NAME, dev_name(chip->dev));
 
-    pr_info("dma-alsa: Returning hw_ptr=%lu frames\n", hw_ptr);
+    err = snd_pcm_new(card, PCM_DEVICE_NAME, 0, 1, capture->dma_channel ? 1 : 0, &chip->pcm);
+    if (err < 0)
+        goto err_card;
 
-    return hw_ptr;
-}
+    chip->pcm->private_data = chip;
 
-/* PCM hw_free callback */
-static int dma_pcm_hw_free(struct snd_pcm_substream *substream)
-{
-    /*
-    This callback is executed by ALSA to free all hardware and buffers
-        The ALSA buffer is freed
-    */
+    // The packers run under the stream lock, a nonatomic PCM keeps interrupts enabled there so the NEON
+    // packers can run, only the refill in the DMA callback needs the atomic stream lock
+    chip->pcm->nonatomic = refill_mode != DMA_REFILL_CALLBACK;
 
-    struct snd_pcm_runtime *runtime = substream->runtime;
+    // ALSA allocates the buffer at hw_params and frees it, cached and DMA-able for the native format and mmap,
+    // in sg mode it is noncontiguous instead, synced the same way
+    snd_pcm_set_managed_buffer(chip->pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream,
+                               sg ? SNDRV_DMA_TYPE_NONCONTIG : SNDRV_DMA_TYPE_NONCOHERENT,
+                               playback->dma_dev, AUDIO_BUFFER_SIZE, AUDIO_BUFFER_SIZE);
+    if (capture->dma_channel)
+        snd_pcm_set_managed_buffer(chip->pcm->streams[SNDRV_PCM_STREAM_CAPTURE].substream,
+                                   sg ? SNDRV_DMA_TYPE_NONCONTIG : SNDRV_DMA_TYPE_NONCOHERENT,
+                                   capture->dma_dev, AUDIO_BUFFER_SIZE, AUDIO_BUFFER_SIZE);
 
-    if (!runtime || !dma_buffer) {
-        pr_err("dma-alsa: hw free failed, invalid runtime or buffer\n");
-        return -EINVAL;
-    }
+    snd_pcm_set_ops(chip->pcm, SNDRV_PCM_STREAM_PLAYBACK, direct_copy ? &dma_pcm_direct_ops : &dma_pcm_ops);
+    if (capture->dma_channel)
+        snd_pcm_set_ops(chip->pcm, SNDRV_PCM_STREAM_CAPTURE, &dma_pcm_ops);
 
-    snd_pcm_lib_free_pages(substream);
-    
-    pr_info("dma-alsa: hw free successful\n");
-    return 0;
-}
+    err = init_controls(chip);
+    if (err < 0)
+        goto err_card;
 
-/* PCM prepare callback */
-static int dma_pcm_prepare(struct snd_pcm_substream *substream)
-{
-    /*
-    The prepare callback is called by ALSA when a sound stream (playback or capture) is ready to start
-    This occurs just before the trigger callback with the SNDRV_PCM_TRIGGER_START command is called
-        The runtime and DMA buffer need to be checked for existance
-        Earlier DMA transfers need to be stopped
-    */
+    // The channels are held until the device was idle for autosuspend_ms, from then on open requests them,
+    // runtime PM is up before the PCM can be opened
+    pm_runtime_set_autosuspend_delay(chip->dev, autosuspend_ms);
+    pm_runtime_use_autosuspend(chip->dev);
+    pm_runtime_set_active(chip->dev);
+    pm_runtime_enable(chip->dev);
 
-    struct snd_pcm_runtime *runtime = substream->runtime;
+    err = snd_card_register(card);
+    if (err < 0)
+        goto err_pm;
 
-    if (!runtime || !dma_buffer) {
-        pr_err("dma-alsa: prepare failed, invalid runtime or buffer\n");
-        return -EINVAL;
-    }
+    init_debugfs(chip);
 
-    if (runtime->buffer_size == 0 || runtime->period_size == 0) {
-        pr_err("dma-alsa: Invalid buffer_size or period_size in prepare\n");
-        return -EINVAL;
-    }
+    pm_runtime_mark_last_busy(chip->dev);
+    pm_runtime_idle(chip->dev);
 
-    pr_info("dma-alsa: preparing hw, resetting DMA and buffers\n");
-    dmaengine_terminate_sync(dma_channel);
-    pr_info("dma-alsa: prepare completed successfully\n");
+    pr_info("dma-alsa: %s: sound card %d registered\n", dev_name(chip->dev), card->number);
     return 0;
+
+err_pm:
+    pm_runtime_disable(chip->dev);
+    pm_runtime_dont_use_autosuspend(chip->dev);
+    pm_runtime_set_suspended(chip->dev);
+err_card:
+    snd_card_free(card);
+    chip->card = NULL;
+err_release:
+    exit_refill_context(chip);
+    release_streams(chip);
+    return err;
 }
 
-/* PCM trigger callback */
-static int dma_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+/* Unbind a device */
+static int dma_alsa_remove(struct platform_device *pdev)
 {
     /*
-    This callback is executed when a certain trigger is sent to the pcm stream: start, stop, pause
-        The received trigger is determined (start / stop)
-        Action is taken accordingly to the trigger type
+    This function is executed when a device is unbound or the module is removed
+        The debugfs files of the device are removed
+        The sound card is unregistered from the system, its streams are closed
+        Scheduled work is flushed and the refill context is torn down
+        The allocated DMA buffers are released if not done yet
+        The DMA channels are released
     */
 
-    struct snd_pcm_runtime *runtime = substream->runtime;
-
-    pr_debug("dma-alsa: Current ALSA state: %d\n", runtime->status->state);
+    struct dma_alsa_chip *chip = platform_get_drvdata(pdev);
 
-    switch (cmd) {
-    case SNDRV_PCM_TRIGGER_START:
-        pr_info("dma-alsa: playback started\n");
-        // Load first period and start DMA
-        dma_state = DMA_ALSA_STATE_RUNNING;
-        write_to_buffer(substream);
-        break;
+    pm_runtime_disable(chip->dev);
+    pm_runtime_dont_use_autosuspend(chip->dev);
+    pm_runtime_set_suspended(chip->dev);
 
-    case SNDRV_PCM_TRIGGER_STOP:
-        pr_info("dma-alsa: playback stopped\n");
-        dmaengine_terminate_sync(dma_channel);
-        dma_state = DMA_ALSA_STATE_STOPPED;
-        break;
+    debugfs_remove_recursive(chip->debugfs_dir);
+    chip->debugfs_dir = NULL;
 
-    case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
-        pr_info("dma-alsa: playback paused\n");
-        dmaengine_pause(dma_channel);
-        break;
+    // The card goes first, it still references the channel devices,
+    // and an open stream may queue refill work until its channels are terminated
+    snd_card_free(chip->card);
+    chip->card = NULL;
 
-    case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
-        pr_info("dma-alsa: playback resumed\n");
-        dmaengine_resume(dma_channel);
-        dma_state = DMA_ALSA_STATE_RUNNING;
-        break;
+    // Flush any pending work
+    exit_refill_context(chip);
 
-    default:
-        pr_err("dma-alsa: unsupported trigger command: %d\n", cmd);
-        return -EINVAL;
-    }
+    release_streams(chip);
 
+    pr_info("dma-alsa: %s: removed\n", dev_name(chip->dev));
     return 0;
 }
 
-/* PCM operations */
-static struct snd_pcm_ops dma_pcm_ops = {
-    /*
-    This struct contains the callback functions for pcm stream operations from ALSA
-    */
-
-    .open = dma_pcm_open,
-    .close = dma_pcm_close,
-    .ioctl = snd_pcm_lib_ioctl,
-    .hw_params = dma_pcm_hw_params,
-    .hw_free = dma_pcm_hw_free,
-    .prepare = dma_pcm_prepare,
-    .trigger = dma_pcm_trigger,
-    .pointer = dma_pcm_pointer,
+static const struct of_device_id dma_alsa_of_match[] = {
+    { .compatible = DMA_ALSA_COMPATIBLE },
+    { }
+};
+MODULE_DEVICE_TABLE(of, dma_alsa_of_match);
+
+static struct platform_driver dma_alsa_driver = {
+    .probe = dma_alsa_probe,
+    .remove = dma_alsa_remove,
+    .driver = {
+        .name = DMA_ALSA_DRIVER_NAME,
+        .of_match_table = dma_alsa_of_match,
+        .pm = pm_ptr(&dma_alsa_pm_ops),
+    },
 };
 
 /* Kernel module init */
@@ -577,55 +3778,65 @@ static int __init dma_pcm_init(void)
 {
     /*
     This function contains the init of the DMA ALSA kernel module
-        A mutex lock for the DMA buffer is created
-        The DMA channel is requested
-        A new sound card is created from this module
-        A new pcm device is created from this module
-        The callback functions for this sound card are set
-        The ALSA buffer is preallocated
-        The sound card is registered with the system
+        The parameters shared by all devices are checked
+        The debugfs directory of the module is created
+        The platform driver is registered, it binds every device tree node of the driver
+        Without any such node 1 legacy device is registered, it uses the named DMA channels
     */
 
+    struct device_node *np;
     int err;
 
-    mutex_init(&dma_lock);
-
     pr_info("dma-alsa: initialization of the module\n");
 
-    err = init_dma_channel();
+    err = init_slot_layout();
     if (err)
         return err;
 
-    err = snd_card_new(dma_channel->device->dev, -1, NULL, THIS_MODULE, 0, &card);
-    if (err < 0)
-        return err;
+    if (pipeline_depth < 1 || pipeline_depth > DMA_MAX_PIPELINE_DEPTH) {
+        unsigned int depth = clamp_t(unsigned int, pipeline_depth, 1, DMA_MAX_PIPELINE_DEPTH);
 
-    snprintf(card->driver, sizeof(card->driver), CARD_NAME);
-    snprintf(card->shortname, sizeof(card->shortname), CARD_NAME);
-    snprintf(card->longname, sizeof(card->longname), CARD_NAME);
+        pr_warn("dma-alsa: pipeline_depth %u out of range, using %u\n", pipeline_depth, depth);
+        pipeline_depth = depth;
+    }
 
-    err = snd_pcm_new(card, PCM_DEVICE_NAME, 0, 1, 0, &pcm);
-    if (err < 0) {
-        snd_card_free(card);
-        return err;
+    if (irq_interval > 1 && cyclic)
+        pr_warn("dma-alsa: irq_interval is ignored in cyclic mode, the cyclic descriptor interrupts per period\n");
+
+    // A cyclic descriptor takes 1 contiguous ring, it has no scatterlist variant
+    if (sg && cyclic) {
+        pr_warn("dma-alsa: sg is ignored in cyclic mode, the cyclic descriptor needs a contiguous ring\n");
+        sg = false;
     }
 
-    snd_pcm_lib_preallocate_pages_for_all(pcm,
-                                      SNDRV_DMA_TYPE_CONTINUOUS,
-                                      NULL,
-                                      AUDIO_BUFFER_SIZE,
-                                      AUDIO_BUFFER_SIZE);
+    // The noncontiguous buffer of sg mode is cached and synced already, noncoherent selects a contiguous one
+    if (noncoherent && sg) {
+        pr_warn("dma-alsa: noncoherent is implied in sg mode\n");
+        noncoherent = false;
+    }
 
-    snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &dma_pcm_ops);
+    dma_debugfs_root = debugfs_create_dir("alsa-axi-dma", NULL);
+    init_selftest();
 
-    err = snd_card_register(card);
-    if (err < 0) {
-        snd_card_free(card);
+    err = platform_driver_register(&dma_alsa_driver);
+    if (err) {
+        debugfs_remove_recursive(dma_debugfs_root);
         return err;
     }
 
-    // Initialize the work struct
-    INIT_WORK(&dma_work, dma_work_handler);
+    np = of_find_compatible_node(NULL, NULL, DMA_ALSA_COMPATIBLE);
+    if (np) {
+        of_node_put(np);
+    } else {
+        legacy_device = platform_device_register_simple(DMA_ALSA_DRIVER_NAME, -1, NULL, 0);
+        if (IS_ERR(legacy_device)) {
+            err = PTR_ERR(legacy_device);
+            legacy_device = NULL;
+            platform_driver_unregister(&dma_alsa_driver);
+            debugfs_remove_recursive(dma_debugfs_root);
+            return err;
+        }
+    }
 
     pr_info("dma-alsa: module successfully initialized\n");
     return 0;
@@ -636,35 +3847,19 @@ static void __exit dma_pcm_exit(void)
 {
     /*
     This function contains the exit of the DMA ALSA kernel module
-        Scheduled work is flushed
-        The allocated DMA buffers is released if not done yet
-        The DMA channel is released
-        The sound card is unregistered from the system
+        The legacy device is unregistered, the driver unbinds all devices
+        The debugfs directory of the module is removed
     */
-   
-    pr_info("dma-alsa: module cleanup started\n");
 
-    // Flush any pending work
-    flush_work(&dma_work);
+    pr_info("dma-alsa: module cleanup started\n");
 
-    if (dma_buffer) {
-        dma_free_coherent(dma_channel->device->dev, AUDIO_BUFFER_SIZE, dma_buffer, dma_handle);
-        dma_buffer = NULL;
-        pr_info("dma-alsa: dma buffer released\n");
-    } else {
-        pr_warn("dma-alsa: dma buffer already released\n");
-    }
+    if (legacy_device)
+        platform_device_unregister(legacy_device);
 
-    if (dma_channel) {
-        dma_release_channel(dma_channel);
-        dma_channel = NULL;
-        pr_info("dma-alsa: dma channel released\n");
-    }
+    platform_driver_unregister(&dma_alsa_driver);
 
-    if (card) {
-        snd_card_free(card);
-        card = NULL;
-    }
+    debugfs_remove_recursive(dma_debugfs_root);
+    dma_debugfs_root = NULL;
 
     pr_info("dma-alsa: module removed\n");
 }
@@ -674,4 +3869,4 @@ module_exit(dma_pcm_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Lander Van Loock");
-MODULE_DESCRIPTION("DMA ALSA PCM kernel module to AXI DMA via DMAengine");
\ No newline at end of file
+MODULE_DESCRIPTION("DMA ALSA PCM kernel module to AXI DMA via DMAengine");
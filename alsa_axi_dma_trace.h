@@ -0,0 +1,163 @@
+/*
+ * Tracepoints of the DMA-based ALSA PCM Module
+ *
+ * The events cover the path of every period through the driver: submission to
+ * the DMA engine, DMA completion, the refill work and the pointer callback, plus
+ * underruns with their cause. Every event carries the stream it belongs to. They are available under events/dma_alsa/ in
+ * tracefs and can be recorded with ftrace, trace-cmd or perf.
+ *
+ * Author: Lander Van Loock
+ * License: GPL
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dma_alsa
+
+#ifndef _ALSA_AXI_DMA_TRACE_DEFS
+#define _ALSA_AXI_DMA_TRACE_DEFS
+
+// Underrun causes
+#define DMA_XRUN_NO_DATA        0   // No packed period left and not enough data for the next one
+#define DMA_XRUN_RING_DRAINED   1   // Cyclic engine moved into a slot that was never packed
+#define DMA_XRUN_START          2   // Not enough data to queue the first period
+#define DMA_XRUN_SUBMIT         3   // A descriptor could not be prepared or submitted
+#define DMA_XRUN_OVERRUN        4   // Capture: the application did not read the ALSA buffer in time
+#define DMA_XRUN_SILENCE        5   // Free-running: a period was padded with silence, the stream kept running
+#define DMA_XRUN_CAUSES         6
+
+#endif
+
+#if !defined(_ALSA_AXI_DMA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ALSA_AXI_DMA_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Stream field, the values are SNDRV_PCM_STREAM_PLAYBACK and SNDRV_PCM_STREAM_CAPTURE
+#define show_dma_alsa_stream(stream) __print_symbolic(stream, { 0, "playback" }, { 1, "capture" })
+
+TRACE_EVENT(dma_alsa_submit,
+    TP_PROTO(int stream, unsigned int slot, unsigned long pos, size_t bytes),
+    TP_ARGS(stream, slot, pos, bytes),
+    TP_STRUCT__entry(
+        __field(int, stream)
+        __field(unsigned int, slot)
+        __field(unsigned long, pos)
+        __field(size_t, bytes)
+    ),
+    TP_fast_assign(
+        __entry->stream = stream;
+        __entry->slot = slot;
+        __entry->pos = pos;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("%s slot=%u pos=%lu bytes=%zu", show_dma_alsa_stream(__entry->stream),
+              __entry->slot, __entry->pos, __entry->bytes)
+);
+
+// The cyclic descriptor does not carry its slot, it is reported as -1
+TRACE_EVENT(dma_alsa_complete,
+    TP_PROTO(int stream, int slot, int pending),
+    TP_ARGS(stream, slot, pending),
+    TP_STRUCT__entry(
+        __field(int, stream)
+        __field(int, slot)
+        __field(int, pending)
+    ),
+    TP_fast_assign(
+        __entry->stream = stream;
+        __entry->slot = slot;
+        __entry->pending = pending;
+    ),
+    TP_printk("%s slot=%d pending=%d", show_dma_alsa_stream(__entry->stream),
+              __entry->slot, __entry->pending)
+);
+
+TRACE_EVENT(dma_alsa_work_start,
+    TP_PROTO(int stream, unsigned int completed, unsigned long hw_ptr, unsigned int queued),
+    TP_ARGS(stream, completed, hw_ptr, queued),
+    TP_STRUCT__entry(
+        __field(int, stream)
+        __field(unsigned int, completed)
+        __field(unsigned long, hw_ptr)
+        __field(unsigned int, queued)
+    ),
+    TP_fast_assign(
+        __entry->stream = stream;
+        __entry->completed = completed;
+        __entry->hw_ptr = hw_ptr;
+        __entry->queued = queued;
+    ),
+    TP_printk("%s completed=%u hw_ptr=%lu queued=%u", show_dma_alsa_stream(__entry->stream),
+              __entry->completed, __entry->hw_ptr, __entry->queued)
+);
+
+TRACE_EVENT(dma_alsa_work_end,
+    TP_PROTO(int stream, unsigned long hw_ptr, unsigned int queued, long ready),
+    TP_ARGS(stream, hw_ptr, queued, ready),
+    TP_STRUCT__entry(
+        __field(int, stream)
+        __field(unsigned long, hw_ptr)
+        __field(unsigned int, queued)
+        __field(long, ready)
+    ),
+    TP_fast_assign(
+        __entry->stream = stream;
+        __entry->hw_ptr = hw_ptr;
+        __entry->queued = queued;
+        __entry->ready = ready;
+    ),
+    TP_printk("%s hw_ptr=%lu queued=%u ready=%ld", show_dma_alsa_stream(__entry->stream),
+              __entry->hw_ptr, __entry->queued, __entry->ready)
+);
+
+TRACE_EVENT(dma_alsa_pointer,
+    TP_PROTO(int stream, unsigned long hw_ptr, unsigned long period_ptr),
+    TP_ARGS(stream, hw_ptr, period_ptr),
+    TP_STRUCT__entry(
+        __field(int, stream)
+        __field(unsigned long, hw_ptr)
+        __field(unsigned long, period_ptr)
+    ),
+    TP_fast_assign(
+        __entry->stream = stream;
+        __entry->hw_ptr = hw_ptr;
+        __entry->period_ptr = period_ptr;
+    ),
+    TP_printk("%s hw_ptr=%lu period_ptr=%lu", show_dma_alsa_stream(__entry->stream),
+              __entry->hw_ptr, __entry->period_ptr)
+);
+
+TRACE_EVENT(dma_alsa_xrun,
+    TP_PROTO(int stream, int cause, unsigned long hw_ptr, long ready),
+    TP_ARGS(stream, cause, hw_ptr, ready),
+    TP_STRUCT__entry(
+        __field(int, stream)
+        __field(int, cause)
+        __field(unsigned long, hw_ptr)
+        __field(long, ready)
+    ),
+    TP_fast_assign(
+        __entry->stream = stream;
+        __entry->cause = cause;
+        __entry->hw_ptr = hw_ptr;
+        __entry->ready = ready;
+    ),
+    TP_printk("%s cause=%s hw_ptr=%lu ready=%ld", show_dma_alsa_stream(__entry->stream),
+              __print_symbolic(__entry->cause,
+                               { DMA_XRUN_NO_DATA, "no_data" },
+                               { DMA_XRUN_RING_DRAINED, "ring_drained" },
+                               { DMA_XRUN_START, "start" },
+                               { DMA_XRUN_SUBMIT, "submit" },
+                               { DMA_XRUN_OVERRUN, "overrun" },
+                               { DMA_XRUN_SILENCE, "silence" }),
+              __entry->hw_ptr, __entry->ready)
+);
+
+#endif /* _ALSA_AXI_DMA_TRACE_H */
+
+// The header is not in include/trace/events, point define_trace.h at the module directory
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE alsa_axi_dma_trace
+#include <trace/define_trace.h>
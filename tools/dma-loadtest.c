@@ -0,0 +1,441 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Load test for the alsa-axi-dma driver
+ *
+ * Streams playback on the dma_pcm device for every combination of sample format,
+ * period size and period count, at full rate and optionally with CPU load threads
+ * running next to it, and reports per combination:
+ * - xruns: underruns seen by snd_pcm_writei(), the stream is prepared again and continues
+ * - wakeups: returns of snd_pcm_wait() per second, one per period is ideal
+ * - delay error: frames played according to snd_pcm_delay() against the frames the
+ *   monotonic clock says should have been played, relative to the first measurement,
+ *   average and worst case in us
+ *
+ * The exit code is 1 when any combination had an xrun or stalled, so the tool can gate
+ * a driver change. Combinations the driver refuses are reported and skipped.
+ *
+ * Build with make loadtest, needs the ALSA library (libasound2-dev).
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#define LOADTEST_PCM_ID "dma_pcm"           // PCM id of the driver
+#define LOADTEST_MAX_LIST 16                // Max number of entries per sweep list
+#define LOADTEST_LOAD_BYTES (1024 * 1024)   // Buffer each load thread copies, larger than the L2 cache
+#define LOADTEST_WAIT_MS 1000               // snd_pcm_wait() timeout, a stream that stalls this long fails
+
+// Sweep and stream settings from the command line
+struct loadtest_config {
+    char device[64];
+    unsigned int rate;
+    unsigned int channels;
+    unsigned int seconds;                   // Streaming time per combination
+    unsigned int load_threads;
+    snd_pcm_format_t formats[LOADTEST_MAX_LIST];
+    unsigned int nformats;
+    unsigned int period_frames[LOADTEST_MAX_LIST];
+    unsigned int nperiod_frames;
+    unsigned int periods[LOADTEST_MAX_LIST];
+    unsigned int nperiods;
+};
+
+// Result of one combination
+struct loadtest_result {
+    snd_pcm_uframes_t period_frames;        // As granted by the driver
+    snd_pcm_uframes_t buffer_frames;
+    unsigned long xruns;
+    unsigned long wakeups;
+    unsigned long delay_samples;
+    double delay_err_sum_us;                // Sum of the absolute delay errors
+    double delay_err_max_us;
+    double seconds;
+    bool stalled;
+};
+
+static volatile bool load_stop;
+
+/* Monotonic clock in seconds */
+static double loadtest_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* CPU load thread: copies a buffer larger than the cache, so it competes for memory bandwidth too */
+static void *loadtest_load_thread(void *arg)
+{
+    uint8_t *buf = malloc(2 * LOADTEST_LOAD_BYTES);
+
+    (void)arg;
+    if (!buf)
+        return NULL;
+
+    memset(buf, 0x55, 2 * LOADTEST_LOAD_BYTES);
+    while (!load_stop)
+        memcpy(buf + LOADTEST_LOAD_BYTES, buf, LOADTEST_LOAD_BYTES);
+
+    free(buf);
+    return NULL;
+}
+
+/* Find the dma_pcm playback device, the first card that has one wins */
+static int loadtest_find_device(char *name, size_t size)
+{
+    /*
+    This function is executed when no device is given on the command line
+        Every card is opened through its control interface and its PCM devices are listed
+        The first playback PCM with the id of the driver is returned as hw:<card>,<device>
+    */
+
+    snd_pcm_info_t *info;
+    snd_ctl_t *ctl;
+    char ctl_name[16];
+    int card = -1;
+    int dev;
+
+    snd_pcm_info_alloca(&info);
+
+    while (snd_card_next(&card) == 0 && card >= 0) {
+        snprintf(ctl_name, sizeof(ctl_name), "hw:%d", card);
+        if (snd_ctl_open(&ctl, ctl_name, 0) < 0)
+            continue;
+
+        dev = -1;
+        while (snd_ctl_pcm_next_device(ctl, &dev) == 0 && dev >= 0) {
+            snd_pcm_info_set_device(info, dev);
+            snd_pcm_info_set_subdevice(info, 0);
+            snd_pcm_info_set_stream(info, SND_PCM_STREAM_PLAYBACK);
+            if (snd_ctl_pcm_info(ctl, info) < 0)
+                continue;
+            if (!strcmp(snd_pcm_info_get_id(info), LOADTEST_PCM_ID)) {
+                snprintf(name, size, "hw:%d,%d", card, dev);
+                snd_ctl_close(ctl);
+                return 0;
+            }
+        }
+        snd_ctl_close(ctl);
+    }
+
+    return -ENODEV;
+}
+
+/* Set the hardware and software parameters of one combination */
+static int loadtest_set_params(snd_pcm_t *pcm, const struct loadtest_config *cfg, snd_pcm_format_t format,
+                               unsigned int period_frames, unsigned int periods, struct loadtest_result *res)
+{
+    /*
+    This function is executed before every combination
+        The driver has to grant the format, the channels and the rate exactly, period size and count are taken as near
+        The stream starts once the buffer is full and wakes up the application once per period
+    */
+
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_uframes_t period = period_frames;
+    unsigned int count = periods;
+    int err;
+
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_sw_params_alloca(&sw);
+
+    snd_pcm_hw_params_any(pcm, hw);
+    if ((err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pcm, hw, format)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(pcm, hw, cfg->channels)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate(pcm, hw, cfg->rate, 0)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_periods_near(pcm, hw, &count, NULL)) < 0 ||
+        (err = snd_pcm_hw_params(pcm, hw)) < 0)
+        return err;
+
+    snd_pcm_hw_params_get_period_size(hw, &res->period_frames, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &res->buffer_frames);
+
+    snd_pcm_sw_params_current(pcm, sw);
+    if ((err = snd_pcm_sw_params_set_avail_min(pcm, sw, res->period_frames)) < 0 ||
+        (err = snd_pcm_sw_params_set_start_threshold(pcm, sw, res->buffer_frames)) < 0 ||
+        (err = snd_pcm_sw_params(pcm, sw)) < 0)
+        return err;
+
+    return 0;
+}
+
+/* Stream one combination for the configured time */
+static int loadtest_stream(snd_pcm_t *pcm, const struct loadtest_config *cfg, snd_pcm_format_t format,
+                           struct loadtest_result *res)
+{
+    /*
+    This function is executed for every combination once its parameters are set
+        A quiet ramp is written whenever the driver wakes up the application, up to the free space
+        After every write the delay is compared to the frames the clock expects to have been played
+        An underrun is counted and the stream is prepared again, the delay reference starts over
+        A stream that does not wake up the application within LOADTEST_WAIT_MS has stalled
+    */
+
+    size_t frame_bytes = snd_pcm_frames_to_bytes(pcm, 1);
+    snd_pcm_uframes_t written = 0;
+    snd_pcm_sframes_t avail, delay, ret;
+    double start, now, ref_time = 0, err_us;
+    long long ref_played = 0;
+    bool have_ref = false;
+    uint8_t *buf;
+    size_t i;
+
+    buf = malloc(res->buffer_frames * frame_bytes);
+    if (!buf)
+        return -ENOMEM;
+    snd_pcm_format_set_silence(format, buf, res->buffer_frames * cfg->channels);
+    for (i = 0; i < res->buffer_frames * frame_bytes; i++)
+        buf[i] |= (i / frame_bytes) & 0x0f;
+
+    start = loadtest_now();
+    now = start;
+    while (now - start < cfg->seconds) {
+        avail = snd_pcm_avail_update(pcm);
+        if (avail == -EPIPE || avail == -ESTRPIPE) {
+            res->xruns++;
+            snd_pcm_prepare(pcm);
+            have_ref = false;
+            continue;
+        }
+
+        if (avail >= 0 && avail < (snd_pcm_sframes_t)res->period_frames &&
+            snd_pcm_state(pcm) == SND_PCM_STATE_RUNNING) {
+            if (snd_pcm_wait(pcm, LOADTEST_WAIT_MS) == 0) {
+                res->stalled = true;
+                break;
+            }
+            res->wakeups++;
+            now = loadtest_now();
+            continue;
+        }
+
+        ret = snd_pcm_writei(pcm, buf, res->period_frames);
+        if (ret == -EPIPE || ret == -ESTRPIPE) {
+            res->xruns++;
+            snd_pcm_prepare(pcm);
+            have_ref = false;
+            continue;
+        }
+        if (ret < 0) {
+            free(buf);
+            return ret;
+        }
+        written += ret;
+        now = loadtest_now();
+
+        if (snd_pcm_state(pcm) != SND_PCM_STATE_RUNNING || snd_pcm_delay(pcm, &delay) < 0)
+            continue;
+
+        // The first measurement of a run is the reference, the clock then predicts the played frames
+        if (!have_ref) {
+            ref_played = (long long)written - delay;
+            ref_time = now;
+            have_ref = true;
+            continue;
+        }
+
+        err_us = (((long long)written - delay - ref_played) - (now - ref_time) * cfg->rate) * 1e6 / cfg->rate;
+        if (err_us < 0)
+            err_us = -err_us;
+        res->delay_err_sum_us += err_us;
+        if (err_us > res->delay_err_max_us)
+            res->delay_err_max_us = err_us;
+        res->delay_samples++;
+    }
+
+    res->seconds = now - start;
+    snd_pcm_drop(pcm);
+    free(buf);
+    return 0;
+}
+
+/* Parse a comma-separated list of numbers */
+static unsigned int loadtest_parse_list(const char *arg, unsigned int *list)
+{
+    unsigned int n = 0;
+    char *end;
+
+    while (*arg && n < LOADTEST_MAX_LIST) {
+        list[n++] = strtoul(arg, &end, 0);
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+
+    return n;
+}
+
+/* Parse a comma-separated list of ALSA format names */
+static unsigned int loadtest_parse_formats(const char *arg, snd_pcm_format_t *list)
+{
+    char copy[256];
+    char *tok, *save;
+    unsigned int n = 0;
+
+    snprintf(copy, sizeof(copy), "%s", arg);
+    for (tok = strtok_r(copy, ",", &save); tok && n < LOADTEST_MAX_LIST; tok = strtok_r(NULL, ",", &save)) {
+        list[n] = snd_pcm_format_value(tok);
+        if (list[n] == SND_PCM_FORMAT_UNKNOWN) {
+            fprintf(stderr, "unknown format %s\n", tok);
+            continue;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+static void loadtest_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -D device     PCM device (default: the first dma_pcm device)\n"
+            "  -r rate       sample rate (default 48000)\n"
+            "  -c channels   channels (default 2)\n"
+            "  -f formats    formats to sweep (default S16_LE,S24_3LE,S24_LE,S32_LE)\n"
+            "  -p frames     period sizes to sweep (default 64,128,256,512,1024,2048)\n"
+            "  -n periods    period counts to sweep (default 2,4,8)\n"
+            "  -t seconds    streaming time per combination (default 5)\n"
+            "  -l threads    CPU load threads next to the stream (default 0)\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    /*
+    This function is executed when the tool starts
+        The command line sets the sweep, the device is looked up when not given
+        The load threads run for the whole sweep, every combination gets a fresh open of the device
+    */
+
+    static const unsigned int default_period_frames[] = { 64, 128, 256, 512, 1024, 2048 };
+    static const unsigned int default_periods[] = { 2, 4, 8 };
+    struct loadtest_config cfg = {
+        .rate = 48000,
+        .channels = 2,
+        .seconds = 5,
+    };
+    pthread_t load[64];
+    unsigned int nload = 0;
+    unsigned int f, p, n;
+    bool failed = false;
+    int opt, err;
+
+    cfg.nformats = loadtest_parse_formats("S16_LE,S24_3LE,S24_LE,S32_LE", cfg.formats);
+    memcpy(cfg.period_frames, default_period_frames, sizeof(default_period_frames));
+    cfg.nperiod_frames = sizeof(default_period_frames) / sizeof(default_period_frames[0]);
+    memcpy(cfg.periods, default_periods, sizeof(default_periods));
+    cfg.nperiods = sizeof(default_periods) / sizeof(default_periods[0]);
+
+    while ((opt = getopt(argc, argv, "D:r:c:f:p:n:t:l:h")) != -1) {
+        switch (opt) {
+        case 'D':
+            snprintf(cfg.device, sizeof(cfg.device), "%s", optarg);
+            break;
+        case 'r':
+            cfg.rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            cfg.channels = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            cfg.nformats = loadtest_parse_formats(optarg, cfg.formats);
+            break;
+        case 'p':
+            cfg.nperiod_frames = loadtest_parse_list(optarg, cfg.period_frames);
+            break;
+        case 'n':
+            cfg.nperiods = loadtest_parse_list(optarg, cfg.periods);
+            break;
+        case 't':
+            cfg.seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            cfg.load_threads = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            loadtest_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!cfg.rate || !cfg.channels || !cfg.seconds) {
+        loadtest_usage(argv[0]);
+        return 2;
+    }
+
+    if (!cfg.device[0] && loadtest_find_device(cfg.device, sizeof(cfg.device))) {
+        fprintf(stderr, "no %s device found, give one with -D\n", LOADTEST_PCM_ID);
+        return 2;
+    }
+
+    for (nload = 0; nload < cfg.load_threads && nload < sizeof(load) / sizeof(load[0]); nload++)
+        if (pthread_create(&load[nload], NULL, loadtest_load_thread, NULL))
+            break;
+
+    printf("device %s, %u Hz, %u channels, %u s per combination, %u load threads\n",
+           cfg.device, cfg.rate, cfg.channels, cfg.seconds, nload);
+    printf("%-8s %7s %7s %7s %9s %12s %12s\n", "format", "period", "buffer", "xruns", "wakeup/s",
+           "delay_avg_us", "delay_max_us");
+
+    for (f = 0; f < cfg.nformats; f++) {
+        for (p = 0; p < cfg.nperiod_frames; p++) {
+            for (n = 0; n < cfg.nperiods; n++) {
+                struct loadtest_result res = { 0 };
+                const char *format = snd_pcm_format_name(cfg.formats[f]);
+                snd_pcm_t *pcm;
+
+                err = snd_pcm_open(&pcm, cfg.device, SND_PCM_STREAM_PLAYBACK, 0);
+                if (err < 0) {
+                    fprintf(stderr, "cannot open %s: %s\n", cfg.device, snd_strerror(err));
+                    failed = true;
+                    goto out;
+                }
+
+                err = loadtest_set_params(pcm, &cfg, cfg.formats[f], cfg.period_frames[p], cfg.periods[n], &res);
+                if (err < 0) {
+                    printf("%-8s %7u %7s unsupported with %u periods (%s)\n", format, cfg.period_frames[p], "-",
+                           cfg.periods[n], snd_strerror(err));
+                    snd_pcm_close(pcm);
+                    continue;
+                }
+
+                err = loadtest_stream(pcm, &cfg, cfg.formats[f], &res);
+                snd_pcm_close(pcm);
+                if (err < 0) {
+                    printf("%-8s %7lu %7lu failed (%s)\n", format, res.period_frames, res.buffer_frames,
+                           snd_strerror(err));
+                    failed = true;
+                    continue;
+                }
+
+                printf("%-8s %7lu %7lu %7lu %9.1f %12.1f %12.1f%s\n", format, res.period_frames,
+                       res.buffer_frames, res.xruns, res.seconds > 0 ? res.wakeups / res.seconds : 0.0,
+                       res.delay_samples ? res.delay_err_sum_us / res.delay_samples : 0.0,
+                       res.delay_err_max_us, res.stalled ? " stalled" : "");
+                fflush(stdout);
+                if (res.xruns || res.stalled)
+                    failed = true;
+            }
+        }
+    }
+
+out:
+    load_stop = true;
+    while (nload--)
+        pthread_join(load[nload], NULL);
+
+    return failed ? 1 : 0;
+}